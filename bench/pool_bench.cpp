@@ -0,0 +1,514 @@
+//
+// Benchmark suite for the thread pools in this tree:
+//
+//   stdx        stdx::thread_pool, shared queue
+//   stdx_ws     stdx::thread_pool, work stealing
+//   extend      extend::thread_pool (thread_pool/)
+//   simple      ThreadPool (thread_simple/)
+//
+// Every pool runs the same workloads through the same adapter, a plain
+// function pointer and argument per task:
+//
+//   throughput  one producer pushes empty tasks, tasks per second
+//   latency     paced pushes, push to start of the task in ns (percentiles)
+//   fanout      push threads*4 tasks at once, wait for the last (percentiles)
+//   prodcons    P producer threads into a pool of C threads, 1:1 to 16:64
+//   scaling     1 us tasks on 1, 2, 4 ... all cores
+//
+// Results go out as CSV (one row per measurement) or JSON, so runs of two
+// releases can be diffed by a script.
+//
+// usage: pool_bench [--format csv|json] [--out FILE] [--pools a,b,...]
+//                   [--tasks N] [--quick]
+//
+
+// Posix header files
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// C 89 header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// C++ 98 header files
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// stdx header files
+#include "stdx/stdx_thread.h"
+#include "stdx/stdx_time.h"
+
+#include "thread_pool/extend_thread.h"
+#include "thread_simple/ThreadPool.h"
+
+
+namespace {
+
+typedef void* (*task_fn)(void*);
+
+// what every benchmark sees of a pool
+class bench_pool
+{
+public:
+    virtual ~bench_pool() { }
+    virtual void push(task_fn fn, void* arg) = 0;
+};
+
+struct bench_task
+{
+    typedef void result_type;
+
+    task_fn m_fn;
+    void* m_arg;
+
+    void operator()()
+    {
+        m_fn(m_arg);
+    }
+};
+
+class stdx_pool : public bench_pool
+{
+private:
+    stdx::thread_pool m_pool;
+
+    static stdx::thread_pool_attr attr(bool stealing)
+    {
+        stdx::thread_pool_attr a;
+        if (stealing)
+            a.m_mode = stdx::schedule_work_stealing;
+        return a;
+    }
+
+public:
+    stdx_pool(int threads, bool stealing) : m_pool(threads, attr(stealing))
+    { }
+
+    ~stdx_pool()
+    {
+        m_pool.shutdown();
+    }
+
+    void push(task_fn fn, void* arg)
+    {
+        bench_task t = { fn, arg };
+        m_pool.push(t);
+    }
+};
+
+class extend_pool : public bench_pool
+{
+private:
+    extend::thread_pool m_pool;
+
+public:
+    explicit extend_pool(int threads) : m_pool(threads)
+    { }
+
+    void push(task_fn fn, void* arg)
+    {
+        bench_task t = { fn, arg };
+        m_pool.push(t);
+    }
+};
+
+class simple_pool : public bench_pool
+{
+private:
+    ThreadPool m_pool;
+
+public:
+    explicit simple_pool(int threads) : m_pool(threads)
+    {
+        m_pool.pool_init();
+    }
+
+    ~simple_pool()
+    {
+        m_pool.pool_destroy();
+    }
+
+    void push(task_fn fn, void* arg)
+    {
+        m_pool.pool_add_worker(fn, arg);
+    }
+};
+
+bench_pool*
+make_pool(const std::string& name, int threads)
+{
+    if (name == "stdx")
+        return new stdx_pool(threads, false);
+    if (name == "stdx_ws")
+        return new stdx_pool(threads, true);
+    if (name == "extend")
+        return new extend_pool(threads);
+    if (name == "simple")
+        return new simple_pool(threads);
+    return NULL;
+}
+
+// ---------------------------------------------------------------- tasks
+
+long g_done = 0;
+
+void
+wait_done(long n)
+{
+    while (__atomic_load_n(&g_done, __ATOMIC_ACQUIRE) < n)
+        sched_yield();
+}
+
+void*
+empty_task(void*)
+{
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// about a microsecond of arithmetic
+void*
+work_task(void*)
+{
+    volatile int x = 0;
+    for (int i = 0; i < 300; ++i)
+        x += i;
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+struct latency_sample
+{
+    int64_t m_sent;
+    int64_t m_latency;
+};
+
+void*
+latency_task(void* arg)
+{
+    latency_sample* s = static_cast<latency_sample*>(arg);
+    s->m_latency = stdx::monotonic_nsec() - s->m_sent;
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+struct fanout_round
+{
+    int m_left;
+    int64_t m_finished;
+};
+
+void*
+fanout_task(void* arg)
+{
+    fanout_round* r = static_cast<fanout_round*>(arg);
+    if (__atomic_sub_fetch(&r->m_left, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        r->m_finished = stdx::monotonic_nsec();
+        __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------- results
+
+struct result
+{
+    std::string m_pool;
+    std::string m_bench;
+    int m_producers;
+    int m_threads;
+    long m_tasks;
+    double m_seconds;
+    double m_ops;           // tasks per second
+    int64_t m_p50;          // latencies in ns, -1 when not measured
+    int64_t m_p90;
+    int64_t m_p99;
+    int64_t m_p999;
+    int64_t m_max;
+
+    result(const std::string& pool, const char* bench, int producers, int threads,
+           long tasks, int64_t ns)
+        : m_pool(pool), m_bench(bench), m_producers(producers), m_threads(threads),
+          m_tasks(tasks), m_seconds(ns / 1e9), m_ops(ns > 0 ? tasks * 1e9 / ns : 0),
+          m_p50(-1), m_p90(-1), m_p99(-1), m_p999(-1), m_max(-1)
+    { }
+
+    void percentiles(std::vector<int64_t>& v)
+    {
+        if (v.empty())
+            return;
+        std::sort(v.begin(), v.end());
+        m_p50 = v[(v.size() - 1) * 50 / 100];
+        m_p90 = v[(v.size() - 1) * 90 / 100];
+        m_p99 = v[(v.size() - 1) * 99 / 100];
+        m_p999 = v[(v.size() - 1) * 999 / 1000];
+        m_max = v.back();
+    }
+};
+
+void
+write_csv(FILE* out, const std::vector<result>& rows)
+{
+    fprintf(out, "pool,bench,producers,threads,tasks,seconds,ops_per_sec,"
+                 "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        const result& r = rows[i];
+        fprintf(out, "%s,%s,%d,%d,%ld,%.6f,%.0f,%lld,%lld,%lld,%lld,%lld\n",
+                r.m_pool.c_str(), r.m_bench.c_str(), r.m_producers, r.m_threads,
+                r.m_tasks, r.m_seconds, r.m_ops, (long long)r.m_p50, (long long)r.m_p90,
+                (long long)r.m_p99, (long long)r.m_p999, (long long)r.m_max);
+    }
+}
+
+void
+write_json(FILE* out, const std::vector<result>& rows, int cores)
+{
+    fprintf(out, "{\n  \"cores\": %d,\n  \"results\": [", cores);
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        const result& r = rows[i];
+        fprintf(out, "%s\n    {\"pool\": \"%s\", \"bench\": \"%s\", \"producers\": %d, "
+                     "\"threads\": %d, \"tasks\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.0f",
+                i == 0 ? "" : ",", r.m_pool.c_str(), r.m_bench.c_str(), r.m_producers,
+                r.m_threads, r.m_tasks, r.m_seconds, r.m_ops);
+        if (r.m_p50 >= 0)
+            fprintf(out, ", \"p50_ns\": %lld, \"p90_ns\": %lld, \"p99_ns\": %lld, "
+                         "\"p999_ns\": %lld, \"max_ns\": %lld",
+                    (long long)r.m_p50, (long long)r.m_p90, (long long)r.m_p99,
+                    (long long)r.m_p999, (long long)r.m_max);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+// ---------------------------------------------------------------- benchmarks
+
+result
+bench_throughput(const std::string& name, int threads, long tasks, task_fn fn, const char* label)
+{
+    bench_pool* pool = make_pool(name, threads);
+    g_done = 0;
+    int64_t start = stdx::monotonic_nsec();
+    for (long i = 0; i < tasks; ++i)
+        pool->push(fn, NULL);
+    wait_done(tasks);
+    int64_t ns = stdx::monotonic_nsec() - start;
+    delete pool;
+    return result(name, label, 1, threads, tasks, ns);
+}
+
+result
+bench_latency(const std::string& name, int threads, long samples)
+{
+    bench_pool* pool = make_pool(name, threads);
+    std::vector<latency_sample> s(samples);
+    g_done = 0;
+    int64_t start = stdx::monotonic_nsec();
+    for (long i = 0; i < samples; ++i)
+    {
+        // a few microseconds apart, so this measures handoff and wakeup
+        // rather than queueing behind earlier samples
+        int64_t next = stdx::monotonic_nsec() + 5000;
+        s[i].m_sent = stdx::monotonic_nsec();
+        pool->push(latency_task, &s[i]);
+        while (stdx::monotonic_nsec() < next)
+            sched_yield();
+    }
+    wait_done(samples);
+    int64_t ns = stdx::monotonic_nsec() - start;
+    delete pool;
+
+    result r(name, "latency", 1, threads, samples, ns);
+    std::vector<int64_t> v(samples);
+    for (long i = 0; i < samples; ++i)
+        v[i] = s[i].m_latency;
+    r.percentiles(v);
+    return r;
+}
+
+result
+bench_fanout(const std::string& name, int threads, long rounds)
+{
+    bench_pool* pool = make_pool(name, threads);
+    int width = threads * 4;
+    std::vector<int64_t> v(rounds);
+    fanout_round round;
+    g_done = 0;
+    int64_t start = stdx::monotonic_nsec();
+    for (long i = 0; i < rounds; ++i)
+    {
+        round.m_left = width;
+        int64_t begin = stdx::monotonic_nsec();
+        for (int k = 0; k < width; ++k)
+            pool->push(fanout_task, &round);
+        wait_done(i + 1);
+        v[i] = round.m_finished - begin;
+    }
+    int64_t ns = stdx::monotonic_nsec() - start;
+    delete pool;
+
+    result r(name, "fanout", 1, threads, rounds * width, ns);
+    r.percentiles(v);
+    return r;
+}
+
+struct producer
+{
+    bench_pool* m_pool;
+    long m_tasks;
+    int* m_go;
+};
+
+void*
+producer_routine(void* arg)
+{
+    producer* p = static_cast<producer*>(arg);
+    while (__atomic_load_n(p->m_go, __ATOMIC_ACQUIRE) == 0)
+        sched_yield();
+    for (long i = 0; i < p->m_tasks; ++i)
+        p->m_pool->push(empty_task, NULL);
+    return NULL;
+}
+
+result
+bench_prodcons(const std::string& name, int producers, int threads, long tasks)
+{
+    bench_pool* pool = make_pool(name, threads);
+    std::vector<producer> args(producers);
+    std::vector<pthread_t> tids(producers);
+    int go = 0;
+    long total = tasks / producers * producers;
+    for (int i = 0; i < producers; ++i)
+    {
+        args[i].m_pool = pool;
+        args[i].m_tasks = tasks / producers;
+        args[i].m_go = &go;
+        pthread_create(&tids[i], NULL, producer_routine, &args[i]);
+    }
+
+    g_done = 0;
+    int64_t start = stdx::monotonic_nsec();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    wait_done(total);
+    int64_t ns = stdx::monotonic_nsec() - start;
+    for (int i = 0; i < producers; ++i)
+        pthread_join(tids[i], NULL);
+    delete pool;
+    return result(name, "prodcons", producers, threads, total, ns);
+}
+
+std::vector<std::string>
+split(const std::string& s)
+{
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos <= s.size())
+    {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos)
+            comma = s.size();
+        if (comma > pos)
+            parts.push_back(s.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    return parts;
+}
+
+int
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--format csv|json] [--out FILE] [--pools stdx,stdx_ws,extend,simple]\n"
+                    "          [--tasks N] [--quick]\n", prog);
+    return 2;
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+    std::string format = "csv";
+    std::string out_path;
+    std::string pools = "stdx,stdx_ws,extend,simple";
+    long tasks = 200000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--quick")
+            tasks = 20000;
+        else if (i + 1 < argc && arg == "--format")
+            format = argv[++i];
+        else if (i + 1 < argc && arg == "--out")
+            out_path = argv[++i];
+        else if (i + 1 < argc && arg == "--pools")
+            pools = argv[++i];
+        else if (i + 1 < argc && arg == "--tasks")
+            tasks = atol(argv[++i]);
+        else
+            return usage(argv[0]);
+    }
+    if ((format != "csv" && format != "json") || tasks <= 0)
+        return usage(argv[0]);
+
+    std::vector<std::string> names = split(pools);
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        bench_pool* probe = make_pool(names[i], 1);
+        if (probe == NULL)
+        {
+            fprintf(stderr, "unknown pool: %s\n", names[i].c_str());
+            return usage(argv[0]);
+        }
+        delete probe;
+    }
+
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+
+    static const int ratios[][2] = {
+        { 1, 1 }, { 1, 4 }, { 4, 4 }, { 4, 16 }, { 16, 16 }, { 16, 64 }
+    };
+
+    std::vector<result> rows;
+    for (size_t p = 0; p < names.size(); ++p)
+    {
+        const std::string& name = names[p];
+        fprintf(stderr, "%s ...\n", name.c_str());
+
+        rows.push_back(bench_throughput(name, cores, tasks, empty_task, "throughput"));
+        rows.push_back(bench_latency(name, cores, tasks / 20));
+        rows.push_back(bench_fanout(name, cores, tasks / 200));
+        for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); ++i)
+            rows.push_back(bench_prodcons(name, ratios[i][0], ratios[i][1], tasks));
+        for (int n = 1; ; n *= 2)
+        {
+            if (n > cores)
+                n = cores;
+            rows.push_back(bench_throughput(name, n, tasks, work_task, "scaling"));
+            if (n == cores)
+                break;
+        }
+    }
+
+    FILE* out = stdout;
+    if (!out_path.empty() && (out = fopen(out_path.c_str(), "w")) == NULL)
+    {
+        perror(out_path.c_str());
+        return 1;
+    }
+    if (format == "csv")
+        write_csv(out, rows);
+    else
+        write_json(out, rows, cores);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
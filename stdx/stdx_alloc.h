@@ -1,6 +1,9 @@
 #ifndef __STDX_ALLOC_H
 #define __STDX_ALLOC_H
 
+// Posix header files
+#include <pthread.h>
+
 // C++ 98 header files
 #include <new>      // for placement new
 #include <cstddef>  // for ptrdiff_t, size_t
@@ -81,6 +84,111 @@ public:
 };
 
 
+//
+// Pool of fixed size blocks. Every thread keeps its own free list, so
+// allocate() and deallocate() neither lock nor share cache lines. A block
+// freed on another thread joins that thread's list; lists longer than
+// max_cached give blocks back to operator delete, and a list is released
+// when its thread exits.
+//
+template <size_t _Size>
+class fixed_pool
+{
+private:
+    union block
+    {
+        block* m_next;
+        char m_data[_Size];
+        long double m_align;
+    };
+
+    struct cache
+    {
+        block* m_head;
+        size_t m_count;
+    };
+
+    static cache*& local_cache()
+    {
+        static __thread cache* s_cache = NULL;
+        return s_cache;
+    }
+
+    static pthread_key_t& cache_key()
+    {
+        static pthread_key_t s_key;
+        return s_key;
+    }
+
+    static void make_key()
+    {
+        pthread_key_create(&cache_key(), &release_cache);
+    }
+
+    static void release_cache(void* arg)
+    {
+        cache* c = static_cast<cache*>(arg);
+        while (c->m_head != NULL)
+        {
+            block* b = c->m_head;
+            c->m_head = b->m_next;
+            ::operator delete(b);
+        }
+        local_cache() = NULL;
+        delete c;
+    }
+
+    static cache* get_cache()
+    {
+        cache* c = local_cache();
+        if (c == NULL)
+        {
+            static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+            pthread_once(&s_once, &make_key);
+
+            c = new cache();
+            c->m_head = NULL;
+            c->m_count = 0;
+            pthread_setspecific(cache_key(), c);
+            local_cache() = c;
+        }
+        return c;
+    }
+
+public:
+    enum { max_cached = 256 };
+
+    static void* allocate()
+    {
+        cache* c = get_cache();
+        block* b = c->m_head;
+        if (b != NULL)
+        {
+            c->m_head = b->m_next;
+            --c->m_count;
+            return b;
+        }
+        return ::operator new(sizeof(block));
+    }
+
+    static void deallocate(void* ptr)
+    {
+        if (ptr == NULL)
+            return;
+
+        cache* c = get_cache();
+        if (c->m_count >= max_cached)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        block* b = static_cast<block*>(ptr);
+        b->m_next = c->m_head;
+        c->m_head = b;
+        ++c->m_count;
+    }
+};
+
 } // namespace stdx
 
 #endif // __STDX_ALLOC_H
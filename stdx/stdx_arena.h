@@ -0,0 +1,275 @@
+#ifndef __STDX_ARENA_H
+#define __STDX_ARENA_H
+
+// Posix header files
+#include <pthread.h>
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+
+// C++ 98 header files
+#include <new>      // for placement new
+#include <vector>
+#include <climits>  // for UINT_MAX
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+
+
+namespace stdx {
+
+//
+// Bump pointer arena for short lived scratch data.
+//
+// allocate() moves a pointer through a chunk and takes a new chunk when
+// it runs out; nothing is freed one by one. mark() and rewind() give
+// everything allocated after the mark back at once, the chunks stay for
+// reuse, so a steady workload stops calling operator new altogether.
+// Destructors are not run: keep to plain data, or destroy objects before
+// rewinding. One thread at a time.
+//
+class arena : private noncopyable
+{
+public:
+    enum { default_align = 16 };
+
+    struct position
+    {
+        size_t m_chunk;
+        char* m_ptr;
+    };
+
+private:
+    struct chunk
+    {
+        char* m_base;
+        size_t m_size;
+    };
+
+    std::vector<chunk> m_chunks;
+    size_t m_current;
+    char* m_ptr;
+    char* m_end;
+    size_t m_chunk_size;
+    // capacity kept when rewound to the start
+    size_t m_retain;
+    size_t m_capacity;
+
+    void* allocate_slow(size_t size, size_t align)
+    {
+        size_t need = size + align - 1;
+        size_t next = m_chunks.empty() ? 0 : m_current + 1;
+        if (next >= m_chunks.size() || m_chunks[next].m_size < need)
+        {
+            // a fresh chunk right after the current one, the ones behind
+            // it are unused anyway
+            chunk c;
+            c.m_size = need > m_chunk_size ? need : m_chunk_size;
+            c.m_base = static_cast<char*>(::operator new(c.m_size));
+            m_chunks.insert(m_chunks.begin() + next, c);
+            m_capacity += c.m_size;
+        }
+        m_current = next;
+        m_ptr = m_chunks[next].m_base;
+        m_end = m_ptr + m_chunks[next].m_size;
+
+        char* p = reinterpret_cast<char*>(((uintptr_t)m_ptr + align - 1) & ~(uintptr_t)(align - 1));
+        m_ptr = p + size;
+        return p;
+    }
+
+    // frees spare chunks (behind the current one) above m_retain bytes
+    void trim()
+    {
+        while (m_capacity > m_retain && m_chunks.size() > m_current + 1)
+        {
+            chunk c = m_chunks.back();
+            m_chunks.pop_back();
+            m_capacity -= c.m_size;
+            ::operator delete(c.m_base);
+        }
+    }
+
+public:
+    explicit arena(size_t chunk_size = 64 * 1024, size_t retain = 1024 * 1024)
+        : m_current(0), m_ptr(NULL), m_end(NULL),
+          m_chunk_size(chunk_size), m_retain(retain), m_capacity(0)
+    { }
+
+    ~arena()
+    {
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+            ::operator delete(m_chunks[i].m_base);
+    }
+
+    // align must be a power of two
+    void* allocate(size_t size, size_t align = default_align)
+    {
+        char* p = reinterpret_cast<char*>(((uintptr_t)m_ptr + align - 1) & ~(uintptr_t)(align - 1));
+        if (m_ptr != NULL && p + size <= m_end)
+        {
+            m_ptr = p + size;
+            return p;
+        }
+        return allocate_slow(size, align);
+    }
+
+    // uninitialized room for n objects of type T
+    template <typename T>
+    T* allocate_array(size_t n)
+    {
+        return static_cast<T*>(allocate(n * sizeof(T), __alignof__(T)));
+    }
+
+    template <typename T>
+    T* create()
+    {
+        return new(allocate(sizeof(T), __alignof__(T))) T();
+    }
+
+    template <typename T, typename A>
+    T* create(const A& a)
+    {
+        return new(allocate(sizeof(T), __alignof__(T))) T(a);
+    }
+
+    position mark() const
+    {
+        position pos;
+        pos.m_chunk = m_current;
+        pos.m_ptr = m_ptr;
+        return pos;
+    }
+
+    // frees everything allocated since pos was taken
+    void rewind(const position& pos)
+    {
+        if (pos.m_ptr == m_ptr)
+            return;
+        m_current = pos.m_chunk;
+        if (pos.m_ptr == NULL)
+        {
+            m_ptr = m_chunks.empty() ? NULL : m_chunks[0].m_base;
+            m_end = m_chunks.empty() ? NULL : m_ptr + m_chunks[0].m_size;
+        }
+        else
+        {
+            m_ptr = pos.m_ptr;
+            m_end = m_chunks[m_current].m_base + m_chunks[m_current].m_size;
+        }
+        // back to the start, whether the mark was taken before the first
+        // allocation or after the first chunk came in
+        if (m_current == 0 && (m_chunks.empty() || m_ptr == m_chunks[0].m_base))
+            trim();
+    }
+
+    void reset()
+    {
+        position start = { 0, NULL };
+        rewind(start);
+    }
+
+    // bytes handed out since the start (alignment padding included)
+    size_t used() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < m_current && i < m_chunks.size(); ++i)
+            n += m_chunks[i].m_size;
+        if (m_ptr != NULL)
+            n += m_ptr - m_chunks[m_current].m_base;
+        return n;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+};
+
+// Rewinds a to where it was when the scope was entered.
+class arena_scope : private noncopyable
+{
+private:
+    arena& m_arena;
+    arena::position m_pos;
+
+public:
+    explicit arena_scope(arena& a) : m_arena(a), m_pos(a.mark())
+    { }
+
+    ~arena_scope()
+    {
+        m_arena.rewind(m_pos);
+    }
+};
+
+// Standard allocator on an arena, for containers of scratch data.
+// deallocate() does nothing, the memory comes back with the arena.
+template <typename _Tp>
+class arena_allocator
+{
+public:
+    typedef size_t     size_type;
+    typedef ptrdiff_t  difference_type;
+    typedef _Tp*       pointer;
+    typedef const _Tp* const_pointer;
+    typedef _Tp&       reference;
+    typedef const _Tp& const_reference;
+    typedef _Tp        value_type;
+
+    template <typename _Tp1>
+    struct rebind
+    { typedef arena_allocator<_Tp1> other; };
+
+    arena* m_arena;
+
+    explicit arena_allocator(arena& a) : m_arena(&a)
+    { }
+
+    template <typename _Tp1>
+    arena_allocator(const arena_allocator<_Tp1>& other) : m_arena(other.m_arena)
+    { }
+
+    pointer allocate(size_type n, const void* hint = 0)
+    { return m_arena->allocate_array<_Tp>(n); }
+
+    void deallocate(pointer ptr, size_type n)
+    { }
+
+    void construct(pointer ptr, const _Tp& value)
+    { new(ptr) _Tp(value); }
+
+    void destroy(pointer ptr)
+    { ptr->~_Tp(); }
+
+    pointer address(reference x) const
+    { return &x; }
+
+    const_pointer address(const_reference x) const
+    { return &x; }
+
+    size_type max_size() const
+    { return size_type(UINT_MAX / sizeof(_Tp)); }
+};
+
+template <typename _Tp1, typename _Tp2>
+inline bool
+operator==(const arena_allocator<_Tp1>& a, const arena_allocator<_Tp2>& b)
+{
+    return a.m_arena == b.m_arena;
+}
+
+template <typename _Tp1, typename _Tp2>
+inline bool
+operator!=(const arena_allocator<_Tp1>& a, const arena_allocator<_Tp2>& b)
+{
+    return a.m_arena != b.m_arena;
+}
+
+} // namespace stdx
+
+
+#endif // __STDX_ARENA_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -1,28 +1,72 @@
 #ifndef __STDX_ATOMIC_H
 #define __STDX_ATOMIC_H
 
+// Size of a cache line on the targets we care about (x86_64, aarch64).
+// Hot data written by different threads should sit on different lines.
+#define STDX_CACHELINE_SIZE     64
+#define STDX_CACHELINE_ALIGNED  __attribute__((aligned(STDX_CACHELINE_SIZE)))
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// C++ 98 header files
+#include <new>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+
 namespace stdx {
 
-// We use GCC's atomic-buitins to implements Atomic operations
-// "In most cases, these builtins are considered a full barrier."
+// Tells the CPU we are in a spin-wait loop (saves power, and on x86 avoids
+// the memory order violation flush when the loop exits).
+inline void
+cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Base of types with STDX_CACHELINE_ALIGNED members which live on the
+// heap. Before C++17 plain new only guarantees 16 bytes of alignment, so
+// the padding would not keep them off their neighbours' cache lines.
+struct cacheline_allocated
+{
+    static void* operator new(size_t size)
+    {
+        void* p = NULL;
+        if (posix_memalign(&p, STDX_CACHELINE_SIZE, size) != 0)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void operator delete(void* p)
+    {
+        free(p);
+    }
+};
+
+// The old interface, kept for existing callers. Loads and stores are
+// sequentially consistent, the read-modify-writes full barriers.
 
 template<typename T>
 inline T sync_fetch(const T *pt)
 {
-   __sync_synchronize();    // full barrier (may be ommited?)
-   T tmp = *pt;
-   __sync_synchronize();    // full barrier
-
-   return tmp;
+    return __atomic_load_n(pt, __ATOMIC_SEQ_CST);
 }
 
 
 template<typename T>
 inline void sync_set(T *pt, T val)
 {
-   __sync_synchronize();    // full barrier
-   *pt = val;
-   __sync_synchronize();    // full barrier (may be ommited?)
+    __atomic_store_n(pt, val, __ATOMIC_SEQ_CST);
 }
 
 
@@ -56,7 +100,312 @@ T sync_add_and_fetch(T* pt, T val)
     return __sync_add_and_fetch(pt, val);
 }
 
-// TODO add support for other atomic operations
+enum memory_order
+{
+    memory_order_relaxed = __ATOMIC_RELAXED,
+    memory_order_consume = __ATOMIC_CONSUME,
+    memory_order_acquire = __ATOMIC_ACQUIRE,
+    memory_order_release = __ATOMIC_RELEASE,
+    memory_order_acq_rel = __ATOMIC_ACQ_REL,
+    memory_order_seq_cst = __ATOMIC_SEQ_CST
+};
+
+inline void
+atomic_thread_fence(memory_order order)
+{
+    __atomic_thread_fence(order);
+}
+
+// orders against a signal handler on the same thread, compiler only
+inline void
+atomic_signal_fence(memory_order order)
+{
+    __atomic_signal_fence(order);
+}
+
+// a failed CAS only loads, so it may not release
+inline memory_order
+atomic_failure_order(memory_order order)
+{
+    if (order == memory_order_acq_rel)
+        return memory_order_acquire;
+    if (order == memory_order_release)
+        return memory_order_relaxed;
+    return order;
+}
+
+// Loads, stores, exchange and CAS of any trivially copyable T of size N.
+template<typename T, size_t N = sizeof(T)>
+struct atomic_ops
+{
+    static T load(const T* p, memory_order order)
+    {
+        T v;
+        __atomic_load(const_cast<T*>(p), &v, order);
+        return v;
+    }
+
+    static void store(T* p, T v, memory_order order)
+    {
+        __atomic_store(p, &v, order);
+    }
+
+    static T exchange(T* p, T v, memory_order order)
+    {
+        T old;
+        __atomic_exchange(p, &v, &old, order);
+        return old;
+    }
+
+    static bool compare_exchange(T* p, T& expected, T desired, bool weak,
+                                 memory_order success, memory_order failure)
+    {
+        return __atomic_compare_exchange(p, &expected, &desired, weak, success, failure);
+    }
+};
+
+#if defined(__x86_64__)
+//
+// 16-byte values (a pointer plus an ABA tag, say) through cmpxchg16b.
+// GCC sends 16-byte __atomic builtins to libatomic unless built with
+// -mcx16; every x86_64 CPU that runs a multi-threaded server has the
+// instruction, so it is used directly. It is a full barrier, so every
+// memory order is honoured, and it is the only way to load 16 bytes
+// atomically: a failed CAS hands back the current value.
+//
+template<typename T>
+struct atomic_ops<T, 16>
+{
+    static bool compare_exchange(T* p, T& expected, T desired, bool,
+                                 memory_order, memory_order)
+    {
+        uint64_t exp[2], des[2];
+        memcpy(exp, &expected, 16);
+        memcpy(des, &desired, 16);
+        bool ok;
+        __asm__ __volatile__("lock cmpxchg16b %1\n\tsete %0"
+                             : "=q"(ok), "+m"(*p), "+a"(exp[0]), "+d"(exp[1])
+                             : "b"(des[0]), "c"(des[1])
+                             : "cc", "memory");
+        if (!ok)
+            memcpy(&expected, exp, 16);
+        return ok;
+    }
+
+    static T load(const T* p, memory_order order)
+    {
+        T v;
+        memset(&v, 0, 16);
+        compare_exchange(const_cast<T*>(p), v, v, false, order, order);
+        return v;
+    }
+
+    static T exchange(T* p, T v, memory_order order)
+    {
+        T old = load(p, memory_order_relaxed);
+        while (!compare_exchange(p, old, v, false, order, order))
+            ;
+        return old;
+    }
+
+    static void store(T* p, T v, memory_order order)
+    {
+        exchange(p, v, order);
+    }
+};
+#endif
+
+// natural alignment for power-of-two sizes up to 16, which the
+// instructions above need; a T with another size keeps its own
+template<typename T, size_t N = sizeof(T)>
+struct atomic_alignment
+{
+    enum { value = ((N & (N - 1)) == 0 && N <= 16) ? N : __alignof__(T) };
+};
+
+// What fetch_add() takes, and by how much a unit moves the stored bits:
+// GCC adds to pointers byte-wise, std::atomic<T*> by elements.
+template<typename T>
+struct atomic_difference
+{
+    typedef T type;
+    enum { scale = 1 };
+};
+
+template<typename T>
+struct atomic_difference<T*>
+{
+    typedef ptrdiff_t type;
+    enum { scale = sizeof(T) };
+};
+
+//
+// std::atomic for C++98 compilers, on the GCC __atomic builtins.
+//
+// Every operation takes an explicit memory order, defaulting to seq_cst
+// like std::atomic; a statistics counter wants memory_order_relaxed, a
+// flag publishing data release on the store and acquire on the load.
+// fetch_and/or/xor are for integers, fetch_add/sub for integers and
+// pointers. 16-byte types get a double-width CAS (see atomic_ops), other
+// sizes without a lock-free instruction need -latomic.
+//
+template<typename T>
+class atomic : private noncopyable
+{
+public:
+    typedef T value_type;
+    typedef typename atomic_difference<T>::type difference_type;
+
+private:
+    T m_value __attribute__((aligned(atomic_alignment<T>::value)));
+
+    static difference_type scaled(difference_type v)
+    {
+        return v * (difference_type)atomic_difference<T>::scale;
+    }
+
+public:
+    atomic() : m_value()
+    { }
+
+    atomic(T v) : m_value(v)
+    { }
+
+    bool is_lock_free() const
+    {
+#if defined(__x86_64__)
+        if (sizeof(T) == 16)
+            return true;
+#endif
+        return __atomic_is_lock_free(sizeof(T), &m_value);
+    }
+
+    T load(memory_order order = memory_order_seq_cst) const
+    {
+        return atomic_ops<T>::load(&m_value, order);
+    }
+
+    void store(T v, memory_order order = memory_order_seq_cst)
+    {
+        atomic_ops<T>::store(&m_value, v, order);
+    }
+
+    T exchange(T v, memory_order order = memory_order_seq_cst)
+    {
+        return atomic_ops<T>::exchange(&m_value, v, order);
+    }
+
+    // On failure expected receives the current value.
+    bool compare_exchange_strong(T& expected, T desired,
+                                 memory_order success, memory_order failure)
+    {
+        return atomic_ops<T>::compare_exchange(&m_value, expected, desired, false, success, failure);
+    }
+
+    bool compare_exchange_strong(T& expected, T desired,
+                                 memory_order order = memory_order_seq_cst)
+    {
+        return compare_exchange_strong(expected, desired, order, atomic_failure_order(order));
+    }
+
+    // may fail spuriously, cheaper in a retry loop on LL/SC machines
+    bool compare_exchange_weak(T& expected, T desired,
+                               memory_order success, memory_order failure)
+    {
+        return atomic_ops<T>::compare_exchange(&m_value, expected, desired, true, success, failure);
+    }
+
+    bool compare_exchange_weak(T& expected, T desired,
+                               memory_order order = memory_order_seq_cst)
+    {
+        return compare_exchange_weak(expected, desired, order, atomic_failure_order(order));
+    }
+
+    // the fetch_xxx() return the previous value
+
+    T fetch_add(difference_type v, memory_order order = memory_order_seq_cst)
+    {
+        return __atomic_fetch_add(&m_value, scaled(v), order);
+    }
+
+    T fetch_sub(difference_type v, memory_order order = memory_order_seq_cst)
+    {
+        return __atomic_fetch_sub(&m_value, scaled(v), order);
+    }
+
+    T fetch_and(T v, memory_order order = memory_order_seq_cst)
+    {
+        return __atomic_fetch_and(&m_value, v, order);
+    }
+
+    T fetch_or(T v, memory_order order = memory_order_seq_cst)
+    {
+        return __atomic_fetch_or(&m_value, v, order);
+    }
+
+    T fetch_xor(T v, memory_order order = memory_order_seq_cst)
+    {
+        return __atomic_fetch_xor(&m_value, v, order);
+    }
+
+    // the operators are seq_cst and return the new value, as in std::atomic
+
+    operator T() const
+    {
+        return load();
+    }
+
+    T operator=(T v)
+    {
+        store(v);
+        return v;
+    }
+
+    T operator++()
+    {
+        return __atomic_add_fetch(&m_value, scaled(1), __ATOMIC_SEQ_CST);
+    }
+
+    T operator--()
+    {
+        return __atomic_sub_fetch(&m_value, scaled(1), __ATOMIC_SEQ_CST);
+    }
+
+    T operator++(int)
+    {
+        return fetch_add(1);
+    }
+
+    T operator--(int)
+    {
+        return fetch_sub(1);
+    }
+
+    T operator+=(difference_type v)
+    {
+        return __atomic_add_fetch(&m_value, scaled(v), __ATOMIC_SEQ_CST);
+    }
+
+    T operator-=(difference_type v)
+    {
+        return __atomic_sub_fetch(&m_value, scaled(v), __ATOMIC_SEQ_CST);
+    }
+
+    T operator&=(T v)
+    {
+        return __atomic_and_fetch(&m_value, v, __ATOMIC_SEQ_CST);
+    }
+
+    T operator|=(T v)
+    {
+        return __atomic_or_fetch(&m_value, v, __ATOMIC_SEQ_CST);
+    }
+
+    T operator^=(T v)
+    {
+        return __atomic_xor_fetch(&m_value, v, __ATOMIC_SEQ_CST);
+    }
+};
 
 } // namespace stdx
 
@@ -0,0 +1,708 @@
+#ifndef __STDX_COROUTINE_H
+#define __STDX_COROUTINE_H
+
+// Everything here needs C++20 coroutines, older compilers see an empty header.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+// Posix header files
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+// C++ 98 header files
+#include <stdexcept>
+#include <exception>
+#include <utility>
+
+// C++ 20 header files
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_mutex.h"
+#include "stdx/stdx_string.h"
+#include "stdx/stdx_future.h"
+#include "stdx/stdx_thread.h"
+
+
+namespace stdx {
+
+// a pool task which resumes a suspended coroutine; trivially copyable,
+// like small_task wants it. m_root is the frame owning the chain of
+// co_awaits m_handle is part of (the co_spawn driver).
+struct co_resume
+{
+    std::coroutine_handle<> m_handle;
+    std::coroutine_handle<> m_root;
+
+    void operator()()
+    {
+        m_handle.resume();
+    }
+};
+
+// A resume disposed instead of run (shutdown() leftovers, a dropped
+// timer) destroys the whole chain from its root, which breaks the future
+// co_spawn gave. Found by ADL from small_task::dispose().
+inline void
+task_disposed(co_resume& r)
+{
+    if (r.m_root)
+        r.m_root.destroy();
+    else
+        r.m_handle.destroy();
+}
+
+// the root of h's chain, h itself for a coroutine type not from here
+template <typename P>
+inline std::coroutine_handle<>
+co_root(std::coroutine_handle<P> h)
+{
+    if constexpr (requires { h.promise().root(); })
+        return h.promise().root();
+    else
+        return h;
+}
+
+template <typename P>
+inline co_resume
+co_resume_of(std::coroutine_handle<P> h)
+{
+    co_resume r = { h, co_root(h) };
+    return r;
+}
+
+template <typename T = void>
+class co_task;
+
+class co_promise_base
+{
+private:
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        // symmetric transfer to whoever awaits us, the stack does not grow
+        // however long a chain of co_awaits gets
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().m_continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        { }
+    };
+
+public:
+    std::coroutine_handle<> m_continuation;
+    std::coroutine_handle<> m_root;
+    std::exception_ptr m_error;
+
+    std::coroutine_handle<> root() const
+    {
+        return m_root;
+    }
+
+    // lazy: the body starts when the task is awaited or spawned
+    std::suspend_always initial_suspend() noexcept
+    {
+        return std::suspend_always();
+    }
+
+    final_awaiter final_suspend() noexcept
+    {
+        return final_awaiter();
+    }
+
+    void unhandled_exception()
+    {
+        m_error = std::current_exception();
+    }
+
+    void rethrow()
+    {
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+};
+
+template <typename T>
+class co_promise : public co_promise_base
+{
+private:
+    std::optional<T> m_value;
+
+public:
+    co_task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U&& value)
+    {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    T result()
+    {
+        rethrow();
+        return std::move(*m_value);
+    }
+};
+
+template <>
+class co_promise<void> : public co_promise_base
+{
+public:
+    co_task<void> get_return_object();
+
+    void return_void()
+    { }
+
+    void result()
+    {
+        rethrow();
+    }
+};
+
+//
+// Result of a coroutine which runs on a thread_pool.
+//
+// The coroutine starts suspended. co_await on the task runs it and
+// resumes the awaiting coroutine with its result (or exception) when it
+// is done; co_spawn() starts it on a pool and gives a future. Inside,
+// co_await on resume_on(), pool_yield(), sleep_for() or an io_poller
+// suspends the coroutine without holding a worker: the worker goes on
+// with other tasks and the coroutine continues as a new pool task later.
+//
+// Move only; destroying a task which has not finished destroys the
+// coroutine frame.
+//
+template <typename T>
+class co_task : private noncopyable
+{
+public:
+    typedef co_promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+private:
+    handle_type m_handle;
+
+    struct awaiter
+    {
+        handle_type m_handle;
+
+        bool await_ready() noexcept
+        {
+            return !m_handle || m_handle.done();
+        }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiting) noexcept
+        {
+            m_handle.promise().m_continuation = awaiting;
+            m_handle.promise().m_root = co_root(awaiting);
+            return m_handle;
+        }
+
+        T await_resume()
+        {
+            if (!m_handle)
+                throw std::logic_error("stdx::co_task: no coroutine");
+            return m_handle.promise().result();
+        }
+    };
+
+public:
+    co_task() noexcept
+    { }
+
+    explicit co_task(handle_type h) noexcept : m_handle(h)
+    { }
+
+    co_task(co_task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr))
+    { }
+
+    co_task& operator=(co_task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~co_task()
+    {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool valid() const noexcept
+    {
+        return static_cast<bool>(m_handle);
+    }
+
+    bool done() const noexcept
+    {
+        return m_handle && m_handle.done();
+    }
+
+    awaiter operator co_await() const noexcept
+    {
+        return awaiter{m_handle};
+    }
+};
+
+template <typename T>
+inline co_task<T>
+co_promise<T>::get_return_object()
+{
+    return co_task<T>(co_task<T>::handle_type::from_promise(*this));
+}
+
+inline co_task<void>
+co_promise<void>::get_return_object()
+{
+    return co_task<void>(co_task<void>::handle_type::from_promise(*this));
+}
+
+// fire and forget coroutine driving a spawned co_task; its frame goes
+// away by itself when it is done
+struct co_detached
+{
+    struct promise_type
+    {
+        co_detached get_return_object()
+        {
+            return co_detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return std::suspend_always();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        { }
+
+        // co_drive catches what the task throws, nothing else gets here
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+
+        // the driver owns the whole chain it awaits
+        std::coroutine_handle<> root()
+        {
+            return std::coroutine_handle<promise_type>::from_promise(*this);
+        }
+    };
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+// The driver's reference on the spawned future, a parameter so that it
+// lives in the frame from the start: a driver destroyed before it set a
+// result (before or while it ran) breaks the future.
+template <typename T>
+class co_result : private noncopyable
+{
+private:
+    future_state<T>* m_state;
+
+public:
+    explicit co_result(future_state<T>* state) noexcept : m_state(state)
+    { }
+
+    co_result(co_result&& other) noexcept : m_state(std::exchange(other.m_state, nullptr))
+    { }
+
+    ~co_result()
+    {
+        if (m_state != NULL)
+        {
+            m_state->set_broken();
+            m_state->release();
+        }
+    }
+
+    future_state<T>* state() const noexcept
+    {
+        return m_state;
+    }
+
+    // the result is set, gives the reference back
+    void done() noexcept
+    {
+        m_state->release();
+        m_state = NULL;
+    }
+};
+
+template <typename T>
+inline co_detached
+co_drive(co_task<T> t, co_result<T> result)
+{
+    try
+    {
+        if constexpr (std::is_void_v<T>)
+        {
+            co_await t;
+            result.state()->set_value();
+        }
+        else
+        {
+            result.state()->set_value(co_await t);
+        }
+    }
+    catch (...)
+    {
+        result.state()->set_exception(std::current_exception());
+    }
+    result.done();
+}
+
+// Starts t on pool, the future gets its result, or get() rethrows the
+// exception escaping t. Gives an invalid future when the pool rejects it
+// (shutdown()). A spawned coroutine whose resume is disposed (shutdown()
+// leftovers) is destroyed and its future breaks.
+template <typename T>
+inline future<T>
+co_spawn(thread_pool& pool, co_task<T> t)
+{
+    future_state<T>* state = future_state<T>::create();
+    future<T> result(state);
+    state->add_ref();
+    co_detached driver = co_drive(std::move(t), co_result<T>(state));
+    co_resume start = co_resume_of(driver.m_handle);
+    if (!pool.push(start))
+    {
+        driver.m_handle.destroy();
+        return future<T>();
+    }
+    return result;
+}
+
+// co_await resume_on(pool): continues on one of pool's workers. Pushed
+// like any task, so from a work stealing worker it stays on its deque.
+struct resume_on
+{
+    thread_pool& m_pool;
+
+    explicit resume_on(thread_pool& pool) : m_pool(pool)
+    { }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    // a rejected push (shutdown()) continues right here
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        return m_pool.push(co_resume_of(h));
+    }
+
+    void await_resume() noexcept
+    { }
+};
+
+// co_await pool_yield(pool): lets the tasks queued so far go first. Goes
+// to the back of the least urgent shared lane, never to the worker's own
+// deque where it would be popped again right away.
+struct pool_yield
+{
+    thread_pool& m_pool;
+
+    explicit pool_yield(thread_pool& pool) : m_pool(pool)
+    { }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        return m_pool.push(co_resume_of(h), ~0u);
+    }
+
+    void await_resume() noexcept
+    { }
+};
+
+// co_await sleep_for(pool, ms): continues on pool after ms milliseconds,
+// through pool's timing wheel (schedule_after()). Does not suspend once
+// the pool is shutting down; a coroutine already sleeping then is
+// destroyed with its dropped timer, like a disposed resume.
+struct sleep_for
+{
+    thread_pool& m_pool;
+    int m_delay_ms;
+
+    sleep_for(thread_pool& pool, int delay_ms) : m_pool(pool), m_delay_ms(delay_ms)
+    { }
+
+    bool await_ready() noexcept
+    {
+        return m_delay_ms <= 0;
+    }
+
+    // a rejected timer (shutdown()) continues right here
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        return m_pool.schedule_after(m_delay_ms, co_resume_of(h)).valid();
+    }
+
+    void await_resume() noexcept
+    { }
+};
+
+//
+// Socket readiness for coroutines on a thread_pool.
+//
+// co_await poller.readable(fd) / writable(fd) suspends the coroutine and
+// arms fd (one shot) in an epoll set; a poller thread pushes it back to
+// the pool once fd is ready. The result is the epoll event mask, 0 when
+// the poller was stopped meanwhile. One coroutine at a time may wait on
+// a given fd. fd stays in the set (disarmed) until it is closed.
+//
+class io_poller : private noncopyable
+{
+private:
+    struct waiter
+    {
+        io_poller* m_poller;
+        int m_fd;
+        uint32_t m_events;
+        uint32_t m_revents;
+        co_resume m_resume;
+        waiter* m_prev;
+        waiter* m_next;
+
+        waiter(io_poller* poller, int fd, uint32_t events)
+            : m_poller(poller), m_fd(fd), m_events(events), m_revents(0),
+              m_prev(NULL), m_next(NULL)
+        { }
+
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename P>
+        bool await_suspend(std::coroutine_handle<P> h)
+        {
+            m_resume = co_resume_of(h);
+            return m_poller->arm(this);
+        }
+
+        uint32_t await_resume() noexcept
+        {
+            return m_revents;
+        }
+    };
+
+    thread_pool& m_pool;
+    int m_epfd;
+    int m_evfd;
+    pthread_t m_tid;
+    mutex m_mutex;
+    // waiters armed and not fired yet, so stop() can resume them
+    waiter* m_waiters;
+    bool m_stop;
+
+    void link(waiter* w)
+    {
+        w->m_prev = NULL;
+        w->m_next = m_waiters;
+        if (m_waiters != NULL)
+            m_waiters->m_prev = w;
+        m_waiters = w;
+    }
+
+    void unlink(waiter* w)
+    {
+        if (w->m_prev != NULL)
+            w->m_prev->m_next = w->m_next;
+        else
+            m_waiters = w->m_next;
+        if (w->m_next != NULL)
+            w->m_next->m_prev = w->m_prev;
+        w->m_prev = w->m_next = NULL;
+    }
+
+    // Returns false (do not suspend) once stopped. The waiter lives in
+    // the coroutine frame, which may be resumed on another thread as soon
+    // as the mutex is released, so nothing touches it after that.
+    bool arm(waiter* w)
+    {
+        lock_guard<mutex> guard(m_mutex);
+        if (m_stop)
+            return false;
+
+        struct epoll_event ev;
+        ev.events = w->m_events | EPOLLONESHOT;
+        ev.data.ptr = w;
+        if (::epoll_ctl(m_epfd, EPOLL_CTL_MOD, w->m_fd, &ev) != 0)
+        {
+            if (errno != ENOENT || ::epoll_ctl(m_epfd, EPOLL_CTL_ADD, w->m_fd, &ev) != 0)
+                throw std::runtime_error(stdx::stdx_strerror("stdx::io_poller::epoll_ctl: "));
+        }
+        link(w);
+        return true;
+    }
+
+    void resume(waiter* w)
+    {
+        co_resume task = w->m_resume;
+        if (!m_pool.push(task))
+            task();
+    }
+
+    void run()
+    {
+        struct epoll_event events[64];
+        for (;;)
+        {
+            int n = ::epoll_wait(m_epfd, events, 64, -1);
+            if (n < 0 && errno != EINTR)
+                break;
+
+            for (int i = 0; i < n; ++i)
+            {
+                if (events[i].data.ptr == NULL)
+                    return;     // stop()
+
+                waiter* w = static_cast<waiter*>(events[i].data.ptr);
+                {
+                    lock_guard<mutex> guard(m_mutex);
+                    unlink(w);
+                }
+                w->m_revents = events[i].events;
+                resume(w);
+            }
+        }
+    }
+
+    static void* routine(void* arg)
+    {
+        static_cast<io_poller*>(arg)->run();
+        return 0;
+    }
+
+public:
+    explicit io_poller(thread_pool& pool)
+        : m_pool(pool), m_epfd(-1), m_evfd(-1), m_waiters(NULL), m_stop(false)
+    {
+        m_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (m_epfd < 0)
+            throw std::runtime_error(stdx::stdx_strerror("stdx::io_poller::epoll_create1: "));
+
+        m_evfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (m_evfd < 0 || ::epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_evfd, &ev) != 0)
+        {
+            std::string err = stdx::stdx_strerror("stdx::io_poller::eventfd: ");
+            if (m_evfd >= 0)
+                ::close(m_evfd);
+            ::close(m_epfd);
+            throw std::runtime_error(err);
+        }
+
+        if (pthread_create(&m_tid, NULL, &io_poller::routine, this) != 0)
+        {
+            std::string err = stdx::stdx_strerror("stdx::io_poller::pthread_create: ");
+            ::close(m_evfd);
+            ::close(m_epfd);
+            throw std::runtime_error(err);
+        }
+    }
+
+    ~io_poller()
+    {
+        stop();
+        ::close(m_evfd);
+        ::close(m_epfd);
+    }
+
+    // Stops the poller thread and resumes every waiting coroutine with
+    // 0. Safe to call more than once.
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(m_mutex);
+            if (m_stop)
+                return;
+            m_stop = true;
+        }
+        uint64_t one = 1;
+        ssize_t ret = ::write(m_evfd, &one, sizeof(one));
+        (void)ret;
+        pthread_join(m_tid, NULL);
+
+        for (;;)
+        {
+            waiter* w;
+            {
+                lock_guard<mutex> guard(m_mutex);
+                w = m_waiters;
+                if (w == NULL)
+                    break;
+                unlink(w);
+                ::epoll_ctl(m_epfd, EPOLL_CTL_DEL, w->m_fd, NULL);
+            }
+            w->m_revents = 0;
+            resume(w);
+        }
+    }
+
+    waiter readable(int fd)
+    {
+        return waiter(this, fd, EPOLLIN | EPOLLRDHUP);
+    }
+
+    waiter writable(int fd)
+    {
+        return waiter(this, fd, EPOLLOUT);
+    }
+
+    // any epoll events, EPOLLERR and EPOLLHUP are always reported
+    waiter wait(int fd, uint32_t events)
+    {
+        return waiter(this, fd, events);
+    }
+};
+
+} // namespace stdx
+
+
+#endif // C++20 coroutines
+
+#endif // __STDX_COROUTINE_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,38 @@
+#ifndef __STDX_FUTEX_H
+#define __STDX_FUTEX_H
+
+// Linux header files
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Posix header files
+#include <unistd.h>
+
+// C 89 header files
+#include <time.h>
+#include <limits.h>
+
+
+namespace stdx {
+
+// Sleeps while *addr == val (returns at once otherwise), until futex_wake
+// on the same address, a signal, or the relative timeout expires.
+inline int
+futex_wait(int* addr, int val, const struct timespec* timeout = NULL)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+// Wakes up to n threads sleeping on addr, returns how many were woken.
+inline int
+futex_wake(int* addr, int n = INT_MAX)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+} // namespace stdx
+
+
+#endif // __STDX_FUTEX_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,520 @@
+#ifndef __STDX_FUTURE_H
+#define __STDX_FUTURE_H
+
+// C 89 header files
+#include <stddef.h>
+#include <assert.h>
+
+// C++ 98 header files
+#include <new>      // for placement new
+#include <stdexcept>
+#if __cplusplus >= 201103L
+#include <utility>  // for std::declval
+#include <exception>    // for std::exception_ptr
+#endif
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_alloc.h"
+#include "stdx/stdx_futex.h"
+
+
+namespace stdx {
+
+// get() on the future of a task which was disposed without running.
+class broken_promise : public std::runtime_error
+{
+public:
+    broken_promise() : std::runtime_error("stdx::future: broken promise")
+    { }
+};
+
+//
+// Result type of calling an F with no arguments. Function pointers and
+// functors with a result_type (boost::bind, std adaptors) work in C++98,
+// C++11 also deduces lambdas.
+//
+template <typename F>
+struct task_result
+{
+#if __cplusplus >= 201103L
+    typedef decltype(std::declval<F&>()()) type;
+#else
+    typedef typename F::result_type type;
+#endif
+};
+
+template <typename R>
+struct task_result<R (*)()>
+{
+    typedef R type;
+};
+
+//
+// Shared state between a submitted task and its futures.
+//
+// m_ready is the futex word, waiters only enter the kernel when it is
+// still 0 and the completing thread only calls futex_wake when somebody
+// announced itself in m_waiters. m_parent links the state to (at most)
+// one when_all/when_any combinator. A broken state is ready without a
+// value, get() throws broken_promise; in C++11 a state completed with
+// set_exception() is broken too, get() rethrows that exception instead.
+//
+class future_state_base : private noncopyable
+{
+private:
+    int m_ready;
+    bool m_broken;
+    int m_waiters;
+    int m_refs;
+    future_state_base* m_parent;
+    size_t m_parent_index;
+#if __cplusplus >= 201103L
+    std::exception_ptr m_error;
+#endif
+
+    static future_state_base* done_mark()
+    {
+        return reinterpret_cast<future_state_base*>(1);
+    }
+
+protected:
+    future_state_base()
+        : m_ready(0), m_broken(false), m_waiters(0), m_refs(1), m_parent(NULL),
+          m_parent_index(0)
+    { }
+
+    virtual ~future_state_base() { }
+
+    // returns the memory to the pool it came from
+    virtual void destroy() = 0;
+
+    // the result is in place, publish it and wake everybody waiting
+    void complete()
+    {
+        __atomic_store_n(&m_ready, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST) > 0)
+            futex_wake(&m_ready);
+
+        future_state_base* parent = __atomic_exchange_n(&m_parent, done_mark(),
+                                                        __ATOMIC_ACQ_REL);
+        if (parent != NULL)
+        {
+            parent->child_ready(m_parent_index);
+            parent->release();
+        }
+    }
+
+public:
+    // called once for every attached child, with its position
+    virtual void child_ready(size_t) { }
+
+    // the task will never run: wake the waiters, get() throws
+    void set_broken()
+    {
+        m_broken = true;
+        complete();
+    }
+
+#if __cplusplus >= 201103L
+    // the task threw e instead of giving a value, get() rethrows it
+    void set_exception(std::exception_ptr e)
+    {
+        m_error = e;
+        m_broken = true;
+        complete();
+    }
+#endif
+
+    // ready, but without a value
+    bool broken() const
+    {
+        return ready() && m_broken;
+    }
+
+    // waits, then throws broken_promise (or the task's exception) if there
+    // is no value
+    void wait_value()
+    {
+        wait();
+#if __cplusplus >= 201103L
+        if (m_error)
+            std::rethrow_exception(m_error);
+#endif
+        if (m_broken)
+            throw broken_promise();
+    }
+
+    void add_ref()
+    {
+        __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+
+    void release()
+    {
+        if (__atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL) == 0)
+            destroy();
+    }
+
+    bool ready() const
+    {
+        return __atomic_load_n(&m_ready, __ATOMIC_ACQUIRE) != 0;
+    }
+
+    void wait()
+    {
+        while (!ready())
+        {
+            __atomic_add_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&m_ready, __ATOMIC_SEQ_CST) == 0)
+                futex_wait(&m_ready, 0);
+            __atomic_sub_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    // Makes parent->child_ready(index) run when this state completes.
+    // Returns false if it has completed already, the caller then reports
+    // it to the parent itself. The parent gets one reference per attach.
+    bool attach(future_state_base* parent, size_t index)
+    {
+        future_state_base* expected = __atomic_load_n(&m_parent, __ATOMIC_ACQUIRE);
+        if (expected == done_mark())
+            return false;
+        if (expected != NULL)
+            throw std::logic_error("stdx::future: already given to when_all/when_any");
+
+        m_parent_index = index;
+        parent->add_ref();
+        if (__atomic_compare_exchange_n(&m_parent, &expected, parent, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+
+        parent->release();
+        if (expected == done_mark())
+            return false;
+        throw std::logic_error("stdx::future: already given to when_all/when_any");
+    }
+};
+
+template <typename R>
+class future_state : public future_state_base
+{
+private:
+    union
+    {
+        char m_buf[sizeof(R)];
+        long double m_align;
+    } m_value;
+
+protected:
+    future_state() { }
+
+    ~future_state()
+    {
+        if (ready() && !broken())
+            reinterpret_cast<R*>(m_value.m_buf)->~R();
+    }
+
+    void destroy()
+    {
+        this->~future_state();
+        fixed_pool<sizeof(future_state)>::deallocate(this);
+    }
+
+public:
+    typedef const R& get_type;
+
+    static future_state* create()
+    {
+        return new(fixed_pool<sizeof(future_state)>::allocate()) future_state;
+    }
+
+    void set_value(const R& val)
+    {
+        new(m_value.m_buf) R(val);
+        complete();
+    }
+
+    const R& get()
+    {
+        wait_value();
+        return *reinterpret_cast<const R*>(m_value.m_buf);
+    }
+};
+
+template <>
+class future_state<void> : public future_state_base
+{
+protected:
+    future_state() { }
+
+    void destroy()
+    {
+        this->~future_state();
+        fixed_pool<sizeof(future_state)>::deallocate(this);
+    }
+
+public:
+    typedef void get_type;
+
+    static future_state* create()
+    {
+        return new(fixed_pool<sizeof(future_state)>::allocate()) future_state;
+    }
+
+    void set_value()
+    {
+        complete();
+    }
+
+    void get()
+    {
+        wait_value();
+    }
+};
+
+//
+// Reference counted handle to the result of a submitted task. Copies
+// share the state, so any of them may wait() or get().
+//
+template <typename R>
+class future
+{
+private:
+    future_state<R>* m_state;
+
+public:
+    typedef R value_type;
+
+    future() : m_state(NULL)
+    { }
+
+    // takes over one reference
+    explicit future(future_state<R>* state) : m_state(state)
+    { }
+
+    future(const future& other) : m_state(other.m_state)
+    {
+        if (m_state != NULL)
+            m_state->add_ref();
+    }
+
+    future& operator=(const future& other)
+    {
+        if (other.m_state != NULL)
+            other.m_state->add_ref();
+        if (m_state != NULL)
+            m_state->release();
+        m_state = other.m_state;
+        return *this;
+    }
+
+    ~future()
+    {
+        if (m_state != NULL)
+            m_state->release();
+    }
+
+    bool valid() const
+    {
+        return m_state != NULL;
+    }
+
+    bool ready() const
+    {
+        assert(m_state != NULL);
+        return m_state->ready();
+    }
+
+    void wait() const
+    {
+        assert(m_state != NULL);
+        m_state->wait();
+    }
+
+    // waits for the task, then returns its result (throws broken_promise
+    // if the task was disposed without running)
+    typename future_state<R>::get_type get() const
+    {
+        assert(m_state != NULL);
+        return m_state->get();
+    }
+
+    future_state<R>* state() const
+    {
+        return m_state;
+    }
+};
+
+template <typename F, typename R>
+struct future_task
+{
+    F m_func;
+    future_state<R>* m_state;
+
+    future_task(const F& f, future_state<R>* state) : m_func(f), m_state(state)
+    { }
+
+    void operator()()
+    {
+        m_state->set_value(m_func());
+        m_state->release();
+    }
+};
+
+template <typename F>
+struct future_task<F, void>
+{
+    F m_func;
+    future_state<void>* m_state;
+
+    future_task(const F& f, future_state<void>* state) : m_func(f), m_state(state)
+    { }
+
+    void operator()()
+    {
+        m_func();
+        m_state->set_value();
+        m_state->release();
+    }
+};
+
+// a future_task thrown away unrun (shutdown leftovers, say) breaks its
+// promise, so nobody waits for it forever, and drops its reference
+template <typename F, typename R>
+inline void
+task_disposed(future_task<F, R>& task)
+{
+    task.m_state->set_broken();
+    task.m_state->release();
+}
+
+// Wraps f into a task which completes the returned future; the task holds
+// one reference on the state until it has run or been disposed.
+template <typename F>
+inline future_task<F, typename task_result<F>::type>
+make_future_task(F f, future<typename task_result<F>::type>& result)
+{
+    typedef typename task_result<F>::type R;
+    future_state<R>* state = future_state<R>::create();
+    state->add_ref();
+    result = future<R>(state);
+    return future_task<F, R>(f, state);
+}
+
+
+class when_all_state : public future_state<void>
+{
+private:
+    size_t m_pending;
+
+    when_all_state() : m_pending(1)
+    { }
+
+protected:
+    void destroy()
+    {
+        this->~when_all_state();
+        fixed_pool<sizeof(when_all_state)>::deallocate(this);
+    }
+
+public:
+    static when_all_state* create()
+    {
+        return new(fixed_pool<sizeof(when_all_state)>::allocate()) when_all_state;
+    }
+
+    void expect_one()
+    {
+        __atomic_add_fetch(&m_pending, 1, __ATOMIC_RELAXED);
+    }
+
+    void child_ready(size_t)
+    {
+        if (__atomic_sub_fetch(&m_pending, 1, __ATOMIC_ACQ_REL) == 0)
+            set_value();
+    }
+};
+
+class when_any_state : public future_state<size_t>
+{
+private:
+    int m_fired;
+
+    when_any_state() : m_fired(0)
+    { }
+
+protected:
+    void destroy()
+    {
+        this->~when_any_state();
+        fixed_pool<sizeof(when_any_state)>::deallocate(this);
+    }
+
+public:
+    static when_any_state* create()
+    {
+        return new(fixed_pool<sizeof(when_any_state)>::allocate()) when_any_state;
+    }
+
+    void child_ready(size_t index)
+    {
+        if (__atomic_exchange_n(&m_fired, 1, __ATOMIC_ACQ_REL) == 0)
+            set_value(index);
+    }
+};
+
+//
+// Combinators over a range of futures (any value type). The returned
+// future becomes ready when all of them / the first of them is ready;
+// when_any's value is the position of that first one in the range, or
+// size_t(-1) for an empty range. A future can be given to one combinator.
+// An invalid future (a rejected submit()) counts as ready at once, like a
+// broken one: it never gets a value.
+//
+template <typename _InputIterator>
+inline future<void>
+when_all(_InputIterator first, _InputIterator last)
+{
+    when_all_state* agg = when_all_state::create();
+    future<void> result(agg);
+
+    for (size_t i = 0; first != last; ++first, ++i)
+    {
+        agg->expect_one();
+        if (!first->valid() || !first->state()->attach(agg, i))
+            agg->child_ready(i);
+    }
+    // drop the guard count which kept it pending while attaching
+    agg->child_ready(size_t(-1));
+    return result;
+}
+
+template <typename _InputIterator>
+inline future<size_t>
+when_any(_InputIterator first, _InputIterator last)
+{
+    when_any_state* agg = when_any_state::create();
+    future<size_t> result(agg);
+
+    if (first == last)
+        agg->child_ready(size_t(-1));
+
+    for (size_t i = 0; first != last; ++first, ++i)
+    {
+        if (!first->valid() || !first->state()->attach(agg, i))
+        {
+            // no need to look at the rest
+            agg->child_ready(i);
+            break;
+        }
+    }
+    return result;
+}
+
+} // namespace stdx
+
+
+#endif // __STDX_FUTURE_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,238 @@
+#ifndef __STDX_GRAPH_H
+#define __STDX_GRAPH_H
+
+// C 89 header files
+#include <stddef.h>
+
+// C++ 98 header files
+#include <vector>
+#include <stdexcept>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_task.h"
+#include "stdx/stdx_future.h"
+#include "stdx/stdx_thread.h"
+
+
+namespace stdx {
+
+struct graph_node : private noncopyable
+{
+    graph_node(task_base* t, size_t index)
+        : m_task(t), m_index(index), m_deps(0), m_pending(0)
+    { }
+
+    ~graph_node()
+    {
+        delete m_task;
+    }
+
+    task_base* m_task;
+    size_t m_index;
+    std::vector<graph_node*> m_successors;
+    int m_deps;         // number of predecessors
+    int m_pending;      // predecessors not finished in the current run
+};
+
+//
+// Dependency graph of tasks, run on a thread_pool.
+//
+// Nodes are added with add() and ordered with precede(). run() pushes the
+// nodes without predecessors; a finishing node counts down the pending
+// predecessors of its successors and pushes those which became ready
+// (from a work stealing worker they go to its own deque), running one of
+// them right away on the same thread. The graph keeps its nodes and
+// edges, so it can be run again (once the last run is finished) without
+// allocating anything but the future.
+//
+class task_graph : private noncopyable
+{
+public:
+    typedef graph_node* node_id;
+
+private:
+    struct node_task
+    {
+        task_graph* m_graph;
+        graph_node* m_node;
+
+        node_task(task_graph* g, graph_node* n) : m_graph(g), m_node(n)
+        { }
+
+        void operator()()
+        {
+            m_graph->execute(m_node);
+        }
+    };
+
+    std::vector<graph_node*> m_nodes;
+    std::vector<node_task> m_roots;
+    bool m_checked;
+    thread_pool* m_pool;
+    future_state<void>* m_state;
+    size_t m_remaining;
+    int m_running;
+
+    void execute(graph_node* node)
+    {
+        while (node != NULL)
+        {
+            node->m_task->run();
+
+            graph_node* next = NULL;
+            for (size_t i = 0; i < node->m_successors.size(); ++i)
+            {
+                graph_node* succ = node->m_successors[i];
+                if (__atomic_sub_fetch(&succ->m_pending, 1, __ATOMIC_ACQ_REL) != 0)
+                    continue;
+                // keep the first ready successor for ourselves
+                if (next == NULL)
+                    next = succ;
+                else
+                    m_pool->push(node_task(this, succ));
+            }
+
+            if (__atomic_sub_fetch(&m_remaining, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                future_state<void>* state = m_state;
+                __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+                state->set_value();
+                state->release();
+            }
+            node = next;
+        }
+    }
+
+    // finds the roots, Kahn's algorithm throws on a cycle
+    void check()
+    {
+        std::vector<int> pending(m_nodes.size());
+        std::vector<graph_node*> ready;
+        m_roots.clear();
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            pending[i] = m_nodes[i]->m_deps;
+            if (pending[i] == 0)
+            {
+                ready.push_back(m_nodes[i]);
+                m_roots.push_back(node_task(this, m_nodes[i]));
+            }
+        }
+
+        size_t seen = 0;
+        while (!ready.empty())
+        {
+            graph_node* node = ready.back();
+            ready.pop_back();
+            ++seen;
+            for (size_t i = 0; i < node->m_successors.size(); ++i)
+            {
+                graph_node* succ = node->m_successors[i];
+                if (--pending[succ->m_index] == 0)
+                    ready.push_back(succ);
+            }
+        }
+        if (seen != m_nodes.size())
+            throw std::logic_error("stdx::task_graph: cycle");
+        m_checked = true;
+    }
+
+public:
+    task_graph()
+        : m_checked(false), m_pool(NULL), m_state(NULL), m_remaining(0), m_running(0)
+    { }
+
+    // the graph must not be running
+    ~task_graph()
+    {
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+            delete m_nodes[i];
+    }
+
+    // f is called once per run()
+    template <typename F>
+    node_id add(F f)
+    {
+        graph_node* node = new graph_node(new task<F>(f), m_nodes.size());
+        m_nodes.push_back(node);
+        m_checked = false;
+        return node;
+    }
+
+    // before runs before after
+    void precede(node_id before, node_id after)
+    {
+        before->m_successors.push_back(after);
+        ++after->m_deps;
+        m_checked = false;
+    }
+
+    size_t size() const
+    {
+        return m_nodes.size();
+    }
+
+    // Starts a run on pool, the future is ready when every node has run.
+    // Throws logic_error when the graph has a cycle or is still running,
+    // gives an invalid future when pool rejects the tasks (shutdown()).
+    future<void> run(thread_pool& pool)
+    {
+        if (__atomic_exchange_n(&m_running, 1, __ATOMIC_ACQUIRE) != 0)
+            throw std::logic_error("stdx::task_graph: already running");
+
+        if (!m_checked)
+        {
+            try
+            {
+                check();
+            }
+            catch (...)
+            {
+                __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+                throw;
+            }
+        }
+
+        future_state<void>* state = future_state<void>::create();
+        future<void> result(state);
+        if (m_nodes.empty())
+        {
+            __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+            state->set_value();
+            return result;
+        }
+
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+            m_nodes[i]->m_pending = m_nodes[i]->m_deps;
+        m_pool = &pool;
+        m_remaining = m_nodes.size();
+        // the running graph holds one reference
+        state->add_ref();
+        m_state = state;
+
+        if (pool.push_bulk(m_roots.begin(), m_roots.end()) == 0)
+        {
+            m_state = NULL;
+            state->release();
+            __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+            return future<void>();
+        }
+        return result;
+    }
+
+    // runs the graph on pool and waits for it
+    void run_and_wait(thread_pool& pool)
+    {
+        future<void> done = run(pool);
+        if (done.valid())
+            done.wait();
+    }
+};
+
+} // namespace stdx
+
+
+#endif // __STDX_GRAPH_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
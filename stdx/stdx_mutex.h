@@ -5,13 +5,26 @@
 // Posix header files
 #include <sys/stat.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
 
 // C 89 header files
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdexcept>
 
+// C++ 98 header files
+#include <string>
+#include <vector>
+
 // stdx header files
 #include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_atomic.h"
+#include "stdx/stdx_futex.h"
+#include "stdx/stdx_stats.h"
+#include "stdx/stdx_time.h"
 
 namespace stdx {
 
@@ -82,15 +95,502 @@ public:
     }
 };
 
-class condition_variable
+// Counters of a profiled futex_mutex, see futex_mutex::stats().
+struct mutex_stats
+{
+    mutex_stats() : m_acquisitions(0), m_contended(0), m_wait_ns(0)
+    { }
+
+    std::string m_name;
+    uint64_t m_acquisitions;    // lock() and successful try_lock()
+    uint64_t m_contended;       // ... which found the mutex taken
+    uint64_t m_wait_ns;         // time those spent getting it
+};
+
+//
+// Mutex built directly on a futex (Drepper, "Futexes Are Tricky", mutex
+// 3): 0 free, 1 locked, 2 locked and maybe waiters. An uncontended lock
+// is one CAS and unlock one exchange, with no syscall. A contended lock
+// spins with exponential backoff (not on a single CPU, where the owner
+// cannot run meanwhile) before it sleeps on the futex; unlock only calls
+// futex_wake when somebody may be asleep.
+//
+// A profiled mutex counts acquisitions, contended acquisitions and the
+// time spent waiting. The counters are written while the mutex is held,
+// so they cost no atomic instructions, and the clock is only read on the
+// contended path. Named profiled mutexes are listed by profiles(), to
+// find the hot locks of a running process.
+//
+// Works with lock_guard; condition_variable needs stdx::mutex.
+//
+class futex_mutex : private noncopyable
+{
+private:
+    int m_state;
+    bool m_profile;
+    uint64_t m_acquisitions;
+    uint64_t m_contended;
+    uint64_t m_wait_ns;
+    std::string m_name;
+    // registry links, for named profiled mutexes
+    futex_mutex* m_prev;
+    futex_mutex* m_next;
+    bool m_registered;
+
+    enum { max_backoff = 64 };
+
+    static pthread_mutex_t& registry_lock()
+    {
+        static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+        return s_lock;
+    }
+
+    static futex_mutex*& registry()
+    {
+        static futex_mutex* s_head = NULL;
+        return s_head;
+    }
+
+    static bool single_cpu()
+    {
+        static int s_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return s_cpus <= 1;
+    }
+
+    void enroll()
+    {
+        pthread_mutex_lock(&registry_lock());
+        m_prev = NULL;
+        m_next = registry();
+        if (m_next != NULL)
+            m_next->m_prev = this;
+        registry() = this;
+        m_registered = true;
+        pthread_mutex_unlock(&registry_lock());
+    }
+
+    void withdraw()
+    {
+        pthread_mutex_lock(&registry_lock());
+        if (m_prev != NULL)
+            m_prev->m_next = m_next;
+        else
+            registry() = m_next;
+        if (m_next != NULL)
+            m_next->m_prev = m_prev;
+        m_registered = false;
+        pthread_mutex_unlock(&registry_lock());
+    }
+
+    void lock_slow()
+    {
+        int64_t start = m_profile ? stdx::monotonic_nsec() : 0;
+
+        bool got = false;
+        if (!single_cpu())
+        {
+            for (unsigned spins = 1; spins <= max_backoff && !got; spins <<= 1)
+            {
+                for (unsigned i = 0; i < spins; ++i)
+                    stdx::cpu_relax();
+                int c = 0;
+                got = __atomic_load_n(&m_state, __ATOMIC_RELAXED) == 0
+                      && __atomic_compare_exchange_n(&m_state, &c, 1, false,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (!got)
+        {
+            // from now on the mutex says "maybe waiters", so whoever
+            // unlocks it wakes one of us
+            while (__atomic_exchange_n(&m_state, 2, __ATOMIC_ACQUIRE) != 0)
+                stdx::futex_wait(&m_state, 2);
+        }
+
+        if (m_profile)
+        {
+            stat_add(m_acquisitions);
+            stat_add(m_contended);
+            stat_add(m_wait_ns, stdx::monotonic_nsec() - start);
+        }
+    }
+
+public:
+    // A named mutex with profile set is also listed by profiles().
+    explicit futex_mutex(bool profile = false, const char* name = NULL)
+        : m_state(0), m_profile(profile), m_acquisitions(0), m_contended(0),
+          m_wait_ns(0), m_prev(NULL), m_next(NULL), m_registered(false)
+    {
+        if (name != NULL)
+            m_name = name;
+        if (profile && name != NULL)
+            enroll();
+    }
+
+    ~futex_mutex()
+    {
+        if (m_registered)
+            withdraw();
+    }
+
+    void lock()
+    {
+        int c = 0;
+        if (__atomic_compare_exchange_n(&m_state, &c, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            if (m_profile)
+                stat_add(m_acquisitions);
+            return;
+        }
+        lock_slow();
+    }
+
+    void unlock()
+    {
+        if (__atomic_exchange_n(&m_state, 0, __ATOMIC_RELEASE) == 2)
+            stdx::futex_wake(&m_state, 1);
+    }
+
+    bool try_lock()
+    {
+        int c = 0;
+        if (!__atomic_compare_exchange_n(&m_state, &c, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return false;
+        if (m_profile)
+            stat_add(m_acquisitions);
+        return true;
+    }
+
+    // Turns the counters on or off; call it while nobody uses the mutex.
+    void set_profiling(bool profile)
+    {
+        m_profile = profile;
+    }
+
+    // the counters so far, read while other threads may be counting
+    mutex_stats stats() const
+    {
+        mutex_stats st;
+        st.m_name = m_name;
+        st.m_acquisitions = stat_load(m_acquisitions);
+        st.m_contended = stat_load(m_contended);
+        st.m_wait_ns = stat_load(m_wait_ns);
+        return st;
+    }
+
+    // Zeroes the counters, hold the mutex while calling it.
+    void reset_stats()
+    {
+        __atomic_store_n(&m_acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_wait_ns, 0, __ATOMIC_RELAXED);
+    }
+
+    // counters of every named profiled futex_mutex alive right now
+    static std::vector<mutex_stats> profiles()
+    {
+        std::vector<mutex_stats> all;
+        pthread_mutex_lock(&registry_lock());
+        for (futex_mutex* m = registry(); m != NULL; m = m->m_next)
+            all.push_back(m->stats());
+        pthread_mutex_unlock(&registry_lock());
+        return all;
+    }
+};
+
+//
+// Writer-preferring reader-writer lock for read-mostly data.
+//
+// Every reader announces itself on a counter of its own CPU, each on its
+// own cache line, so readers on different CPUs never share a line: a read
+// lock is one atomic add on a local line plus a load of the writer count.
+// A writer first raises the writer count, which turns newly arriving
+// readers away (they back out and sleep until no writer is left), then
+// takes the writer mutex and waits for the per-CPU counters to sum to 0.
+// Writing costs O(CPUs), and readers cannot starve a writer: once one
+// waits, no new reader gets in.
+//
+// A reader may unlock on another CPU than it locked on; only the sum of
+// the counters means anything, which is why they are 64 bits wide.
+//
+class shared_mutex : private noncopyable
+{
+private:
+    struct reader_slot
+    {
+        int64_t m_count;
+        char m_pad[STDX_CACHELINE_SIZE - sizeof(int64_t)];
+    };
+
+    reader_slot* m_slots;
+    unsigned m_mask;
+    futex_mutex m_wlock;
+    int m_writers STDX_CACHELINE_ALIGNED;  // writers holding or wanting the lock
+    int m_drain;                            // bumped when a reader leaves for a writer
+
+    int64_t* my_slot()
+    {
+        int cpu = sched_getcpu();
+        return &m_slots[(unsigned)(cpu < 0 ? 0 : cpu) & m_mask].m_count;
+    }
+
+    int64_t readers() const
+    {
+        int64_t n = 0;
+        for (unsigned i = 0; i <= m_mask; ++i)
+            n += __atomic_load_n(&m_slots[i].m_count, __ATOMIC_SEQ_CST);
+        return n;
+    }
+
+    void leave(int64_t* slot)
+    {
+        __atomic_sub_fetch(slot, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_writers, __ATOMIC_SEQ_CST) != 0)
+        {
+            __atomic_add_fetch(&m_drain, 1, __ATOMIC_SEQ_CST);
+            stdx::futex_wake(&m_drain, 1);
+        }
+    }
+
+    // with the writer mutex held and m_writers raised
+    void wait_readers()
+    {
+        unsigned spins = 0;
+        for (;;)
+        {
+            int gen = __atomic_load_n(&m_drain, __ATOMIC_SEQ_CST);
+            if (readers() == 0)
+                return;
+            if (spins < 64)
+            {
+                ++spins;
+                stdx::cpu_relax();
+                continue;
+            }
+            stdx::futex_wait(&m_drain, gen);
+        }
+    }
+
+    void writer_done()
+    {
+        if (__atomic_sub_fetch(&m_writers, 1, __ATOMIC_SEQ_CST) == 0)
+            stdx::futex_wake(&m_writers);
+    }
+
+public:
+    shared_mutex() : m_slots(NULL), m_mask(0), m_writers(0), m_drain(0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        unsigned n = 1;
+        while ((long)n < cpus && n < 256)
+            n <<= 1;
+
+        void* mem = NULL;
+        if (posix_memalign(&mem, STDX_CACHELINE_SIZE, n * sizeof(reader_slot)) != 0)
+        {
+            throw std::runtime_error("posix_memalign");
+        }
+        memset(mem, 0, n * sizeof(reader_slot));
+        m_slots = static_cast<reader_slot*>(mem);
+        m_mask = n - 1;
+    }
+
+    ~shared_mutex()
+    {
+        free(m_slots);
+    }
+
+    void lock_shared()
+    {
+        for (;;)
+        {
+            int64_t* slot = my_slot();
+            __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+            int w = __atomic_load_n(&m_writers, __ATOMIC_SEQ_CST);
+            if (w == 0)
+                return;
+
+            // a writer is in or waiting, make way for it
+            leave(slot);
+            while ((w = __atomic_load_n(&m_writers, __ATOMIC_SEQ_CST)) != 0)
+                stdx::futex_wait(&m_writers, w);
+        }
+    }
+
+    bool try_lock_shared()
+    {
+        int64_t* slot = my_slot();
+        __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_writers, __ATOMIC_SEQ_CST) == 0)
+            return true;
+        leave(slot);
+        return false;
+    }
+
+    void unlock_shared()
+    {
+        leave(my_slot());
+    }
+
+    void lock()
+    {
+        __atomic_add_fetch(&m_writers, 1, __ATOMIC_SEQ_CST);
+        m_wlock.lock();
+        wait_readers();
+    }
+
+    bool try_lock()
+    {
+        __atomic_add_fetch(&m_writers, 1, __ATOMIC_SEQ_CST);
+        if (m_wlock.try_lock())
+        {
+            if (readers() == 0)
+                return true;
+            m_wlock.unlock();
+        }
+        writer_done();
+        return false;
+    }
+
+    void unlock()
+    {
+        m_wlock.unlock();
+        writer_done();
+    }
+};
+
+// lock_guard for the read side of a shared_mutex
+template<typename _Mutex>
+class shared_lock_guard
+{
+public:
+    typedef _Mutex mutex_type;
+
+    explicit shared_lock_guard(mutex_type& __m) : _M_device(__m)
+    { _M_device.lock_shared(); }
+
+    ~shared_lock_guard()
+    { _M_device.unlock_shared(); }
+
+private:
+    explicit shared_lock_guard(const shared_lock_guard&);
+    shared_lock_guard& operator=(const shared_lock_guard&);
+
+    mutex_type&  _M_device;
+};
+
+//
+// Sequence lock around a small POD value, e.g. a configuration snapshot.
+//
+// Readers never write shared memory: load() copies the value and retries
+// if the sequence number was odd (write in progress) or moved meanwhile.
+// Writers are serialized by a futex_mutex and make the sequence odd while
+// they copy. Reads are wait-free as long as nobody writes, so this fits
+// data read all the time and written rarely; _Tp must be trivially
+// copyable, a torn copy is thrown away, never looked at.
+//
+template<typename _Tp>
+class seqlock : private noncopyable
+{
+private:
+    unsigned m_seq STDX_CACHELINE_ALIGNED;
+    _Tp m_value;
+    futex_mutex m_wlock;
+
+    void begin_write()
+    {
+        m_wlock.lock();
+        __atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void end_write()
+    {
+        __atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELEASE);
+        m_wlock.unlock();
+    }
+
+public:
+    seqlock() : m_seq(0), m_value()
+    { }
+
+    explicit seqlock(const _Tp& value) : m_seq(0), m_value(value)
+    { }
+
+    _Tp load() const
+    {
+        _Tp copy;
+        unsigned spins = 0;
+        for (;;)
+        {
+            unsigned seq = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+            if ((seq & 1) == 0)
+            {
+                memcpy(&copy, &m_value, sizeof(_Tp));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&m_seq, __ATOMIC_RELAXED) == seq)
+                    return copy;
+            }
+            // the writer may have been preempted halfway
+            if (++spins & 63)
+                stdx::cpu_relax();
+            else
+                sched_yield();
+        }
+    }
+
+    void store(const _Tp& value)
+    {
+        begin_write();
+        memcpy(&m_value, &value, sizeof(_Tp));
+        end_write();
+    }
+
+    // calls f(_Tp&) on the value in place, readers see all of it or none
+    template<typename _Fn>
+    void update(_Fn f)
+    {
+        begin_write();
+        f(m_value);
+        end_write();
+    }
+
+    // grows by 2 per write and is odd during one, to tell if anything changed
+    unsigned version() const
+    {
+        return __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+    }
+};
+
+enum cv_status { no_timeout, timeout };
+
+//
+// Condition variable on a stdx::mutex. Its clock is CLOCK_MONOTONIC
+// unless told otherwise, so timed waits do not stretch or shrink when
+// somebody sets the wall clock; wait_until() deadlines are nanoseconds
+// of that clock (monotonic_nsec(), or now()).
+//
+// Plain waits may wake up spuriously, the predicate versions loop until
+// pred() holds and hand back its last value.
+//
+class condition_variable : private noncopyable
 {
 private:
     pthread_cond_t m_cond;
+    clockid_t m_clock;
 
 public:
-    condition_variable()
+    explicit condition_variable(clockid_t clock = CLOCK_MONOTONIC) : m_clock(clock)
     {
-        int ret = pthread_cond_init(&m_cond, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        int ret = pthread_condattr_setclock(&attr, clock);
+        if (ret == 0)
+            ret = pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
         if (ret != 0)
         {
             throw std::runtime_error("pthread_cond_init");
@@ -109,13 +609,65 @@ public:
 
     void notify_all()
     {
-        ret = pthread_cond_broadcast(&m_cond);
+        pthread_cond_broadcast(&m_cond);
+    }
+
+    // the time on our clock, in nanoseconds
+    int64_t now() const
+    {
+        struct timespec ts;
+        clock_gettime(m_clock, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
     }
 
     void wait(mutex& mtx)
     {
         pthread_cond_wait(&m_cond, mtx.native_handle());
     }
+
+    template <typename _Predicate>
+    void wait(mutex& mtx, _Predicate pred)
+    {
+        while (!pred())
+            wait(mtx);
+    }
+
+    cv_status wait_until(mutex& mtx, int64_t deadline_ns)
+    {
+        struct timespec ts;
+        ts.tv_sec = deadline_ns / 1000000000;
+        ts.tv_nsec = deadline_ns % 1000000000;
+        if (ts.tv_nsec < 0)
+        {
+            ts.tv_sec -= 1;
+            ts.tv_nsec += 1000000000;
+        }
+        int ret = pthread_cond_timedwait(&m_cond, mtx.native_handle(), &ts);
+        return ret == ETIMEDOUT ? timeout : no_timeout;
+    }
+
+    template <typename _Predicate>
+    bool wait_until(mutex& mtx, int64_t deadline_ns, _Predicate pred)
+    {
+        while (!pred())
+        {
+            if (wait_until(mtx, deadline_ns) == timeout)
+                return pred();
+        }
+        return true;
+    }
+
+    cv_status wait_for(mutex& mtx, int timeout_ms)
+    {
+        return wait_until(mtx, now() + (int64_t)timeout_ms * 1000000);
+    }
+
+    // the deadline is fixed up front, spurious wakeups do not extend it
+    template <typename _Predicate>
+    bool wait_for(mutex& mtx, int timeout_ms, _Predicate pred)
+    {
+        return wait_until(mtx, now() + (int64_t)timeout_ms * 1000000, pred);
+    }
 };
 
 } // namespace stdx
@@ -0,0 +1,469 @@
+#ifndef __STDX_PARALLEL_H
+#define __STDX_PARALLEL_H
+
+// Posix header files
+#include <sched.h>
+
+// C 89 header files
+#include <stddef.h>
+
+// C++ 98 header files
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <vector>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_atomic.h"
+#include "stdx/stdx_futex.h"
+#include "stdx/stdx_thread.h"
+
+
+namespace stdx {
+
+//
+// Fork/join on a thread_pool. fork() pushes a task, join() (also run by
+// the destructor) waits for all of them. While waiting the thread runs
+// queued tasks itself; a pool worker never sleeps here, so nested
+// fork/joins cannot starve the pool. Other threads sleep on a futex once
+// there is nothing left to help with.
+//
+// A helped task may fork and join in turn, and from the shared queue it
+// is rarely one of our own, so helping nests. Past max_help_depth levels
+// fork() runs f inline: such a task waits for nothing queued and the
+// stack stays bounded.
+//
+class fork_join : private noncopyable
+{
+private:
+    enum { sleeping = 1 << 30 };
+    enum { max_help_depth = 16 };
+
+    thread_pool& m_pool;
+    // pending forks, plus the sleeping bit while join() is on the futex
+    int m_pending;
+
+    template <typename F>
+    struct forked
+    {
+        fork_join* m_owner;
+        F m_func;
+
+        forked(fork_join* owner, const F& f) : m_owner(owner), m_func(f)
+        { }
+
+        void operator()()
+        {
+            m_func();
+            m_owner->finished();
+        }
+    };
+
+    // how deep the calling thread is nested in join() helping
+    static unsigned& help_depth()
+    {
+        static __thread unsigned s_depth = 0;
+        return s_depth;
+    }
+
+    void finished()
+    {
+        // the owner may return as soon as the count is 0, touch nothing
+        // but the futex address after that
+        int old = __atomic_fetch_sub(&m_pending, 1, __ATOMIC_ACQ_REL);
+        if (old == (sleeping | 1))
+            stdx::futex_wake(&m_pending);
+    }
+
+public:
+    explicit fork_join(thread_pool& pool) : m_pool(pool), m_pending(0)
+    { }
+
+    ~fork_join()
+    {
+        join();
+    }
+
+    thread_pool& pool()
+    {
+        return m_pool;
+    }
+
+    // f runs on the pool, or right here once the pool rejects tasks or
+    // helping is nested too deep
+    template <typename F>
+    void fork(F f)
+    {
+        if (help_depth() >= max_help_depth)
+        {
+            f();
+            return;
+        }
+        __atomic_add_fetch(&m_pending, 1, __ATOMIC_RELAXED);
+        if (!m_pool.push(forked<F>(this, f)))
+        {
+            f();
+            finished();
+        }
+    }
+
+    void join()
+    {
+        bool worker = m_pool.is_worker();
+        for (;;)
+        {
+            int pending = __atomic_load_n(&m_pending, __ATOMIC_ACQUIRE);
+            if ((pending & ~sleeping) == 0)
+                break;
+            ++help_depth();
+            bool helped = m_pool.run_one();
+            --help_depth();
+            if (helped)
+                continue;
+            if (worker)
+            {
+                stdx::cpu_relax();
+                continue;
+            }
+            if (!(pending & sleeping)
+                && !__atomic_compare_exchange_n(&m_pending, &pending, pending | sleeping, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                continue;
+            stdx::futex_wait(&m_pending, pending | sleeping);
+        }
+        __atomic_store_n(&m_pending, 0, __ATOMIC_RELAXED);
+    }
+};
+
+// grain 0 picks about 8 pieces per worker
+inline size_t
+parallel_grain(thread_pool& pool, size_t n, size_t grain)
+{
+    if (grain > 0)
+        return grain;
+    size_t pieces = 8 * (pool.threads() > 0 ? pool.threads() : 1);
+    return n / pieces > 0 ? n / pieces : 1;
+}
+
+template <typename F>
+inline void
+parallel_for_range_impl(fork_join& fj, size_t first, size_t last, size_t grain, const F& f);
+
+template <typename F>
+struct parallel_range_task
+{
+    fork_join* m_fj;
+    const F* m_func;
+    size_t m_first;
+    size_t m_last;
+    size_t m_grain;
+
+    void operator()()
+    {
+        fork_join fj(m_fj->pool());
+        parallel_for_range_impl(fj, m_first, m_last, m_grain, *m_func);
+    }
+};
+
+// Lazy binary splitting: a work stealing worker only splits off the upper
+// half while its own deque is empty (thieves took the last half, or
+// nobody has pushed yet), otherwise it works through the range one grain
+// at a time. Other threads split down to the grain.
+template <typename F>
+inline void
+parallel_for_range_impl(fork_join& fj, size_t first, size_t last, size_t grain, const F& f)
+{
+    thread_pool& pool = fj.pool();
+    while (last - first > grain)
+    {
+        if (pool.local_backlog() == 0)
+        {
+            size_t mid = first + (last - first) / 2;
+            parallel_range_task<F> upper = { &fj, &f, mid, last, grain };
+            fj.fork(upper);
+            last = mid;
+        }
+        else
+        {
+            f(first, first + grain);
+            first += grain;
+        }
+    }
+    if (first < last)
+        f(first, last);
+}
+
+//
+// Calls f(begin, end) for pieces of [first, last) of about grain
+// indices, in parallel on pool, and returns when all are done. f is
+// shared by all pieces (by reference) and must be safe to call
+// concurrently. grain 0 picks one.
+//
+template <typename F>
+inline void
+parallel_for_range(thread_pool& pool, size_t first, size_t last, size_t grain, F f)
+{
+    if (first >= last)
+        return;
+    fork_join fj(pool);
+    parallel_for_range_impl(fj, first, last, parallel_grain(pool, last - first, grain), f);
+}
+
+template <typename F>
+struct parallel_for_body
+{
+    const F* m_func;
+
+    void operator()(size_t first, size_t last) const
+    {
+        for (size_t i = first; i < last; ++i)
+            (*m_func)(i);
+    }
+};
+
+// calls f(i) for every i in [first, last), see parallel_for_range()
+template <typename F>
+inline void
+parallel_for(thread_pool& pool, size_t first, size_t last, size_t grain, F f)
+{
+    parallel_for_body<F> body = { &f };
+    parallel_for_range(pool, first, last, grain, body);
+}
+
+template <typename _InputIterator, typename _OutputIterator, typename F>
+struct parallel_transform_body
+{
+    _InputIterator m_in;
+    _OutputIterator m_out;
+    const F* m_func;
+
+    void operator()(size_t first, size_t last) const
+    {
+        _InputIterator in = m_in + first;
+        _OutputIterator out = m_out + first;
+        for (size_t i = first; i < last; ++i, ++in, ++out)
+            *out = (*m_func)(*in);
+    }
+};
+
+// out[i] = f(first[i]) for the whole range; random access iterators
+template <typename _InputIterator, typename _OutputIterator, typename F>
+inline _OutputIterator
+parallel_transform(thread_pool& pool, _InputIterator first, _InputIterator last,
+                   _OutputIterator out, size_t grain, F f)
+{
+    size_t n = last - first;
+    parallel_transform_body<_InputIterator, _OutputIterator, F> body = { first, out, &f };
+    parallel_for_range(pool, 0, n, grain, body);
+    return out + n;
+}
+
+template <typename T, typename F, typename Op>
+struct parallel_reduce_body
+{
+    size_t m_first;
+    size_t m_last;
+    size_t m_grain;
+    T* m_partials;
+    const F* m_func;
+    const Op* m_op;
+
+    // [first, last) are chunk numbers here
+    void operator()(size_t first, size_t last) const
+    {
+        for (size_t k = first; k < last; ++k)
+        {
+            size_t b = m_first + k * m_grain;
+            size_t e = std::min(b + m_grain, m_last);
+            T acc = (*m_func)(b);
+            for (size_t i = b + 1; i < e; ++i)
+                acc = (*m_op)(acc, (*m_func)(i));
+            m_partials[k] = acc;
+        }
+    }
+};
+
+//
+// op(...op(op(init, f(first)), f(first + 1))..., f(last - 1)), with op
+// only assumed to be associative: every chunk of grain indices is folded
+// in parallel, the chunk results are then folded in order. The result
+// does not depend on the number of threads.
+//
+template <typename T, typename F, typename Op>
+inline T
+parallel_reduce(thread_pool& pool, size_t first, size_t last, size_t grain,
+                T init, F f, Op op)
+{
+    if (first >= last)
+        return init;
+    grain = parallel_grain(pool, last - first, grain);
+    size_t chunks = (last - first + grain - 1) / grain;
+    std::vector<T> partials(chunks, init);
+
+    parallel_reduce_body<T, F, Op> body = { first, last, grain, &partials[0], &f, &op };
+    parallel_for_range(pool, 0, chunks, 1, body);
+
+    T result = init;
+    for (size_t k = 0; k < chunks; ++k)
+        result = op(result, partials[k]);
+    return result;
+}
+
+template <typename _InputIterator1, typename _InputIterator2, typename _OutputIterator,
+          typename _Compare>
+inline void
+parallel_merge_impl(fork_join& fj, _InputIterator1 first1, _InputIterator1 last1,
+                    _InputIterator2 first2, _InputIterator2 last2,
+                    _OutputIterator out, size_t grain, _Compare comp);
+
+template <typename _InputIterator1, typename _InputIterator2, typename _OutputIterator,
+          typename _Compare>
+struct parallel_merge_task
+{
+    fork_join* m_fj;
+    _InputIterator1 m_first1;
+    _InputIterator1 m_last1;
+    _InputIterator2 m_first2;
+    _InputIterator2 m_last2;
+    _OutputIterator m_out;
+    size_t m_grain;
+    _Compare m_comp;
+
+    void operator()()
+    {
+        fork_join fj(m_fj->pool());
+        parallel_merge_impl(fj, m_first1, m_last1, m_first2, m_last2, m_out, m_grain, m_comp);
+    }
+};
+
+// Divide and conquer merge: the middle element of the longer input splits
+// the shorter one by binary search, both halves merge independently.
+template <typename _InputIterator1, typename _InputIterator2, typename _OutputIterator,
+          typename _Compare>
+inline void
+parallel_merge_impl(fork_join& fj, _InputIterator1 first1, _InputIterator1 last1,
+                    _InputIterator2 first2, _InputIterator2 last2,
+                    _OutputIterator out, size_t grain, _Compare comp)
+{
+    size_t n1 = last1 - first1;
+    size_t n2 = last2 - first2;
+    if (n1 + n2 <= grain)
+    {
+        std::merge(first1, last1, first2, last2, out, comp);
+        return;
+    }
+    if (n1 < n2)
+    {
+        // the same with the inputs swapped; the types are the same in every
+        // caller, so this stays one instantiation
+        parallel_merge_impl(fj, first2, last2, first1, last1, out, grain, comp);
+        return;
+    }
+
+    _InputIterator1 mid1 = first1 + n1 / 2;
+    _InputIterator2 mid2 = std::lower_bound(first2, last2, *mid1, comp);
+    _OutputIterator mid_out = out + (mid1 - first1) + (mid2 - first2);
+    *mid_out = *mid1;
+
+    parallel_merge_task<_InputIterator1, _InputIterator2, _OutputIterator, _Compare> upper =
+        { &fj, mid1 + 1, last1, mid2, last2, mid_out + 1, grain, comp };
+    fj.fork(upper);
+    parallel_merge_impl(fj, first1, mid1, first2, mid2, out, grain, comp);
+}
+
+template <typename _RandomAccessIterator, typename _BufferIterator, typename _Compare>
+inline void
+parallel_sort_impl(fork_join& fj, _RandomAccessIterator first, _RandomAccessIterator last,
+                   _BufferIterator buf, bool in_place, size_t grain, _Compare comp);
+
+template <typename _RandomAccessIterator, typename _BufferIterator, typename _Compare>
+struct parallel_sort_task
+{
+    fork_join* m_fj;
+    _RandomAccessIterator m_first;
+    _RandomAccessIterator m_last;
+    _BufferIterator m_buf;
+    bool m_in_place;
+    size_t m_grain;
+    _Compare m_comp;
+
+    void operator()()
+    {
+        fork_join fj(m_fj->pool());
+        parallel_sort_impl(fj, m_first, m_last, m_buf, m_in_place, m_grain, m_comp);
+    }
+};
+
+// Sorts [first, last) into itself (in_place) or into buf. The halves sort
+// into the other array, so every level merges from one array into the
+// other without copying back.
+template <typename _RandomAccessIterator, typename _BufferIterator, typename _Compare>
+inline void
+parallel_sort_impl(fork_join& fj, _RandomAccessIterator first, _RandomAccessIterator last,
+                   _BufferIterator buf, bool in_place, size_t grain, _Compare comp)
+{
+    size_t n = last - first;
+    if (n <= grain)
+    {
+        std::sort(first, last, comp);
+        if (!in_place)
+            std::copy(first, last, buf);
+        return;
+    }
+
+    _RandomAccessIterator mid = first + n / 2;
+    {
+        fork_join halves(fj.pool());
+        parallel_sort_task<_RandomAccessIterator, _BufferIterator, _Compare> upper =
+            { &halves, mid, last, buf + n / 2, !in_place, grain, comp };
+        halves.fork(upper);
+        parallel_sort_impl(halves, first, mid, buf, !in_place, grain, comp);
+    }
+
+    fork_join merge(fj.pool());
+    if (in_place)
+        parallel_merge_impl(merge, buf, buf + n / 2, buf + n / 2, buf + n, first, grain, comp);
+    else
+        parallel_merge_impl(merge, first, mid, mid, last, buf, grain, comp);
+}
+
+//
+// Merge sort on pool, not stable. Pieces of grain elements (0: pick one)
+// are sorted with std::sort, then merged level by level with parallel
+// merges. Needs a buffer of last - first elements.
+//
+template <typename _RandomAccessIterator, typename _Compare>
+inline void
+parallel_sort(thread_pool& pool, _RandomAccessIterator first, _RandomAccessIterator last,
+              size_t grain, _Compare comp)
+{
+    typedef typename std::iterator_traits<_RandomAccessIterator>::value_type _ValueType;
+
+    size_t n = last - first;
+    if (n < 2)
+        return;
+    grain = parallel_grain(pool, n, grain);
+    if (grain < 2)
+        grain = 2;
+
+    std::vector<_ValueType> buf(n);
+    fork_join fj(pool);
+    parallel_sort_impl(fj, first, last, buf.begin(), true, grain, comp);
+}
+
+template <typename _RandomAccessIterator>
+inline void
+parallel_sort(thread_pool& pool, _RandomAccessIterator first, _RandomAccessIterator last,
+              size_t grain = 0)
+{
+    typedef typename std::iterator_traits<_RandomAccessIterator>::value_type _ValueType;
+    parallel_sort(pool, first, last, grain, std::less<_ValueType>());
+}
+
+} // namespace stdx
+
+
+#endif // __STDX_PARALLEL_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,339 @@
+#ifndef __STDX_QUEUE_H
+#define __STDX_QUEUE_H
+
+// C 89 header files
+#include <stddef.h>
+#include <assert.h>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_atomic.h"
+
+
+namespace stdx {
+
+inline size_t
+round_up_pow2(size_t n)
+{
+    size_t v = 1;
+    while (v < n)
+        v <<= 1;
+    return v;
+}
+
+//
+// Chase-Lev work stealing deque (fixed capacity).
+//
+// The owner thread push()es and pop()s at the bottom (LIFO), any other
+// thread may steal() from the top (FIFO). _Tp is copied with plain
+// assignment and must be trivially copyable: a thief may read a slot
+// that is being recycled, the copy is thrown away when its CAS on m_top
+// fails.
+//
+template <typename _Tp>
+class work_stealing_deque : private noncopyable
+{
+private:
+    long m_top STDX_CACHELINE_ALIGNED;
+    long m_bottom STDX_CACHELINE_ALIGNED;
+    _Tp* m_buffer STDX_CACHELINE_ALIGNED;
+    size_t m_mask;
+
+public:
+    explicit work_stealing_deque(size_t capacity = 1024)
+        : m_top(0), m_bottom(0)
+    {
+        size_t size = round_up_pow2(capacity < 2 ? 2 : capacity);
+        m_buffer = new _Tp[size];
+        m_mask = size - 1;
+    }
+
+    ~work_stealing_deque()
+    {
+        delete [] m_buffer;
+    }
+
+    // owner only, returns false when the deque is full
+    bool push(const _Tp& val)
+    {
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        if (b - t > (long)m_mask)
+            return false;
+
+        m_buffer[b & m_mask] = val;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // owner only, takes the most recently pushed element
+    bool pop(_Tp& val)
+    {
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&m_bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long t = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+
+        if (t > b)
+        {
+            // empty
+            __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        val = m_buffer[b & m_mask];
+        if (t == b)
+        {
+            // last element, race against thieves
+            bool won = __atomic_compare_exchange_n(&m_top, &t, t + 1, false,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+            __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELAXED);
+            return won;
+        }
+        return true;
+    }
+
+    // any thread, takes the oldest element
+    bool steal(_Tp& val)
+    {
+        long t = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+            return false;
+
+        _Tp tmp = m_buffer[t & m_mask];
+        if (!__atomic_compare_exchange_n(&m_top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return false;
+
+        val = tmp;
+        return true;
+    }
+
+    // approximate when called concurrently
+    size_t size() const
+    {
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+        long t = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        return b > t ? (size_t)(b - t) : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+};
+
+//
+// Bounded multi-producer/multi-consumer ring buffer (Dmitry Vyukov's
+// sequence number scheme). Every cell carries a sequence number telling
+// producers and consumers whose turn it is, so neither side takes a lock;
+// they only race on m_enqueue_pos or m_dequeue_pos with one CAS.
+//
+template <typename _Tp>
+class mpmc_queue : public cacheline_allocated, private noncopyable
+{
+private:
+    struct cell
+    {
+        size_t m_seq;
+        _Tp m_data;
+    };
+
+    cell* m_buffer;
+    size_t m_mask;
+    size_t m_enqueue_pos STDX_CACHELINE_ALIGNED;
+    size_t m_dequeue_pos STDX_CACHELINE_ALIGNED;
+
+public:
+    explicit mpmc_queue(size_t capacity = 1024)
+        : m_enqueue_pos(0), m_dequeue_pos(0)
+    {
+        size_t size = round_up_pow2(capacity < 2 ? 2 : capacity);
+        m_buffer = new cell[size];
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+            __atomic_store_n(&m_buffer[i].m_seq, i, __ATOMIC_RELAXED);
+    }
+
+    ~mpmc_queue()
+    {
+        delete [] m_buffer;
+    }
+
+    // returns false when the queue is full
+    bool try_push(const _Tp& val)
+    {
+        cell* c;
+        size_t pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+        for (;;)
+        {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = __atomic_load_n(&c->m_seq, __ATOMIC_ACQUIRE);
+            ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (dif == 0)
+            {
+                if (__atomic_compare_exchange_n(&m_enqueue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+            }
+        }
+
+        c->m_data = val;
+        __atomic_store_n(&c->m_seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // returns false when the queue is empty
+    bool try_pop(_Tp& val)
+    {
+        cell* c;
+        size_t pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+        for (;;)
+        {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = __atomic_load_n(&c->m_seq, __ATOMIC_ACQUIRE);
+            ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+            if (dif == 0)
+            {
+                if (__atomic_compare_exchange_n(&m_dequeue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+            }
+        }
+
+        val = c->m_data;
+        __atomic_store_n(&c->m_seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // approximate when called concurrently
+    size_t size() const
+    {
+        size_t d = __atomic_load_n(&m_dequeue_pos, __ATOMIC_ACQUIRE);
+        size_t e = __atomic_load_n(&m_enqueue_pos, __ATOMIC_ACQUIRE);
+        return e > d ? e - d : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+};
+
+//
+// Single producer, single consumer ring (fixed capacity).
+//
+// Each side owns its index and keeps a stale copy of the other side's,
+// reloading it only when the ring looks full (producer) or empty
+// (consumer). In steady state neither side reads the other's cache line,
+// and no operation needs more than a release store.
+//
+template <typename _Tp>
+class spsc_queue : public cacheline_allocated, private noncopyable
+{
+private:
+    _Tp* m_buffer;
+    size_t m_mask;
+    size_t m_head STDX_CACHELINE_ALIGNED;   // next to pop, consumer only
+    size_t m_tail_cache;                    // consumer's copy of m_tail
+    size_t m_tail STDX_CACHELINE_ALIGNED;   // next to push, producer only
+    size_t m_head_cache;                    // producer's copy of m_head
+
+public:
+    explicit spsc_queue(size_t capacity = 1024)
+        : m_head(0), m_tail_cache(0), m_tail(0), m_head_cache(0)
+    {
+        size_t size = round_up_pow2(capacity < 2 ? 2 : capacity);
+        m_buffer = new _Tp[size];
+        m_mask = size - 1;
+    }
+
+    ~spsc_queue()
+    {
+        delete [] m_buffer;
+    }
+
+    // producer only, returns false when the queue is full
+    bool try_push(const _Tp& val)
+    {
+        size_t tail = m_tail;
+        if (tail - m_head_cache > m_mask)
+        {
+            m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            if (tail - m_head_cache > m_mask)
+                return false;
+        }
+        m_buffer[tail & m_mask] = val;
+        __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // consumer only, returns false when the queue is empty
+    bool try_pop(_Tp& val)
+    {
+        size_t head = m_head;
+        if (head == m_tail_cache)
+        {
+            m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+            if (head == m_tail_cache)
+                return false;
+        }
+        val = m_buffer[head & m_mask];
+        __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // approximate when called concurrently
+    size_t size() const
+    {
+        size_t h = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        size_t t = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        return t > h ? t - h : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+};
+
+} // namespace stdx
+
+
+#endif // __STDX_QUEUE_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
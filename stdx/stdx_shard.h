@@ -0,0 +1,559 @@
+#ifndef __STDX_SHARD_H
+#define __STDX_SHARD_H
+
+// Posix header files
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+// C++ 98 header files
+#include <deque>
+#include <map>
+#include <vector>
+#include <stdexcept>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_atomic.h"
+#include "stdx/stdx_small_task.h"
+#include "stdx/stdx_task.h"
+#include "stdx/stdx_queue.h"
+#include "stdx/stdx_future.h"
+#include "stdx/stdx_stats.h"
+#include "stdx/stdx_sysinfo.h"
+#include "stdx/stdx_string.h"
+#include "stdx/stdx_arena.h"
+#include "stdx/stdx_thread.h"   // for this_worker::arena()
+
+
+namespace stdx {
+
+class shard_executor;
+
+// callback of a watched fd, see this_shard::watch()
+class shard_watch : private noncopyable
+{
+public:
+    virtual ~shard_watch() { }
+    virtual void call(uint32_t revents) = 0;
+};
+
+template <typename F>
+class shard_watch_impl : public shard_watch
+{
+private:
+    F m_func;
+
+public:
+    explicit shard_watch_impl(const F& f) : m_func(f)
+    { }
+
+    void call(uint32_t revents)
+    {
+        m_func(revents);
+    }
+};
+
+//
+// One shard: a thread, its queues, its epoll reactor. Everything but the
+// inbound queues is touched by the shard thread only.
+//
+struct shard : public cacheline_allocated, private noncopyable
+{
+    typedef spsc_queue<small_task> ring;
+
+    shard(shard_executor* owner, int index, int cpu, size_t shards)
+        : m_owner(owner), m_index(index), m_cpu(cpu), m_started(false),
+          m_inbox(shards, (ring*)NULL), m_epfd(-1), m_evfd(-1),
+          m_sleeping(0), m_executed(0)
+    { }
+
+    ~shard()
+    {
+        small_task task;
+        while (!m_local.empty())
+        {
+            m_local.front().dispose();
+            m_local.pop_front();
+        }
+        for (size_t i = 0; i < m_inbox.size(); ++i)
+        {
+            if (m_inbox[i] == NULL)
+                continue;
+            while (m_inbox[i]->try_pop(task))
+                task.dispose();
+            delete m_inbox[i];
+        }
+        for (std::map<int, shard_watch*>::iterator it = m_watches.begin();
+             it != m_watches.end(); ++it)
+            delete it->second;
+        for (size_t i = 0; i < m_retired.size(); ++i)
+            delete m_retired[i];
+        if (m_evfd >= 0)
+            ::close(m_evfd);
+        if (m_epfd >= 0)
+            ::close(m_epfd);
+    }
+
+    shard_executor* m_owner;
+    int m_index;
+    int m_cpu;              // -1 when not pinned
+    pthread_t m_tid;
+    bool m_started;
+    // tasks the shard pushed to itself
+    std::deque<small_task> m_local;
+    // m_inbox[i] carries tasks from shard i, created by shard i on its
+    // first push (NULL until then)
+    std::vector<ring*> m_inbox;
+    // tasks from threads outside the executor, and rings that were full
+    task_pool m_remote;
+    int m_epfd;
+    int m_evfd;             // in m_epfd, written to wake the shard
+    std::map<int, shard_watch*> m_watches;
+    // unwatched or replaced callbacks, deleted once none of them can be
+    // running (a callback may unwatch its own fd)
+    std::vector<shard_watch*> m_retired;
+    // 1 while the shard is (about to be) blocked in epoll_wait
+    int m_sleeping STDX_CACHELINE_ALIGNED;
+    uint64_t m_executed;
+};
+
+// the shard running on the calling thread, NULL for other threads
+inline shard*&
+current_shard()
+{
+    static __thread shard* s_shard = NULL;
+    return s_shard;
+}
+
+//
+// Thread-per-core executor: shared nothing, one pinned thread per shard.
+//
+// A shard runs its own tasks; nothing is stolen or balanced. Work gets to
+// a shard through push_to()/submit_to(): from the shard itself it goes to
+// a private deque, from another shard through an SPSC ring (one per
+// ordered pair of shards, a full mesh, so no two producers share one),
+// from any other thread through the shard's mutex protected queue, which
+// also takes a task when the ring is full. Tasks from one shard to
+// another run in order unless a ring overflowed.
+//
+// Each shard has an epoll reactor (this_shard::watch()) and a scratch
+// arena (this_shard::arena()) rewound after every task, so connection
+// state partitioned by shard is only ever touched by one thread. An idle
+// shard blocks in epoll_wait; a push wakes it through an eventfd only
+// when it is actually asleep.
+//
+class shard_executor : private noncopyable
+{
+private:
+    std::vector<shard*> m_shards;
+    size_t m_ring_capacity;
+    int m_stop;
+    // pushes from outside in progress, stop() waits for them
+    int m_pushers STDX_CACHELINE_ALIGNED;
+
+    // runs a task in its own arena scope
+    static void run(shard* s, small_task& task)
+    {
+        arena_scope scope(this_worker::arena());
+        task.run();
+        stat_add(s->m_executed);
+    }
+
+    bool has_work(shard* s)
+    {
+        if (!s->m_local.empty() || s->m_remote.size() > 0)
+            return true;
+        for (size_t i = 0; i < s->m_inbox.size(); ++i)
+        {
+            shard::ring* r = __atomic_load_n(&s->m_inbox[i], __ATOMIC_ACQUIRE);
+            if (r != NULL && !r->empty())
+                return true;
+        }
+        return false;
+    }
+
+    // Runs what is ready on the fds, blocks up to timeout_ms (-1: until
+    // something happens). Returns the number of callbacks run.
+    size_t poll(shard* s, int timeout_ms)
+    {
+        struct epoll_event events[64];
+        int n = ::epoll_wait(s->m_epfd, events, 64, timeout_ms);
+        size_t ran = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == s->m_evfd)
+            {
+                uint64_t count;
+                ssize_t ret = ::read(s->m_evfd, &count, sizeof(count));
+                (void)ret;
+                continue;
+            }
+            // looked up again, an earlier callback may have unwatched it
+            std::map<int, shard_watch*>::iterator it = s->m_watches.find(fd);
+            if (it == s->m_watches.end())
+                continue;
+            {
+                arena_scope scope(this_worker::arena());
+                it->second->call(events[i].events);
+            }
+            ++ran;
+            for (size_t k = 0; k < s->m_retired.size(); ++k)
+                delete s->m_retired[k];
+            s->m_retired.clear();
+        }
+        return ran;
+    }
+
+    void loop(shard* s)
+    {
+        std::vector<small_task> batch(64);
+        unsigned rounds = 0;
+        while (__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE) == 0)
+        {
+            size_t ran = 0;
+
+            // only what was there before, tasks pushed meanwhile wait a round
+            for (size_t n = s->m_local.size(); n > 0; --n)
+            {
+                small_task task = s->m_local.front();
+                s->m_local.pop_front();
+                run(s, task);
+                ++ran;
+            }
+
+            small_task task;
+            for (size_t i = 0; i < s->m_inbox.size(); ++i)
+            {
+                shard::ring* r = __atomic_load_n(&s->m_inbox[i], __ATOMIC_ACQUIRE);
+                for (size_t n = 0; r != NULL && n < batch.size() && r->try_pop(task); ++n)
+                {
+                    run(s, task);
+                    ++ran;
+                }
+            }
+
+            size_t n = s->m_remote.pop_bulk(&batch[0], batch.size());
+            for (size_t i = 0; i < n; ++i)
+                run(s, batch[i]);
+            ran += n;
+
+            if (!s->m_watches.empty() && (ran == 0 || ++rounds % 64 == 0))
+                ran += poll(s, 0);
+            if (ran > 0)
+                continue;
+
+            // pairs with the fence in wake(): either we see the task or
+            // the pusher sees us asleep
+            __atomic_store_n(&s->m_sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!has_work(s) && __atomic_load_n(&m_stop, __ATOMIC_SEQ_CST) == 0)
+            {
+                poll(s, -1);
+            }
+            __atomic_store_n(&s->m_sleeping, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct start_arg
+    {
+        shard_executor* m_executor;
+        shard* m_shard;
+    };
+
+    static void* routine(void* arg)
+    {
+        start_arg* start = static_cast<start_arg*>(arg);
+        shard* s = start->m_shard;
+        shard_executor* self = start->m_executor;
+        delete start;
+
+        current_shard() = s;
+        self->loop(s);
+        current_shard() = NULL;
+        return 0;
+    }
+
+    // after a task was queued for s
+    void wake(shard* s)
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->m_sleeping, __ATOMIC_RELAXED) != 0
+            && __atomic_exchange_n(&s->m_sleeping, 0, __ATOMIC_ACQ_REL) != 0)
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(s->m_evfd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+
+    // the calling thread's shard if it belongs to us
+    shard* local_shard()
+    {
+        shard* s = current_shard();
+        return s != NULL && s->m_owner == this ? s : NULL;
+    }
+
+    bool push_task(int index, const small_task& task)
+    {
+        shard* to = m_shards[index];
+        shard* from = local_shard();
+        if (from == to)
+        {
+            from->m_local.push_back(task);
+            return true;
+        }
+        if (from != NULL)
+        {
+            shard::ring* r = to->m_inbox[from->m_index];
+            if (r == NULL)
+            {
+                r = new shard::ring(m_ring_capacity);
+                __atomic_store_n(&to->m_inbox[from->m_index], r, __ATOMIC_RELEASE);
+            }
+            if (!r->try_push(task))
+                to->m_remote.push(task);
+            wake(to);
+            return true;
+        }
+
+        __atomic_add_fetch(&m_pushers, 1, __ATOMIC_SEQ_CST);
+        bool accepted = __atomic_load_n(&m_stop, __ATOMIC_SEQ_CST) == 0;
+        if (accepted)
+        {
+            to->m_remote.push(task);
+            wake(to);
+        }
+        __atomic_sub_fetch(&m_pushers, 1, __ATOMIC_SEQ_CST);
+        return accepted;
+    }
+
+    void start(shard* s)
+    {
+        s->m_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (s->m_epfd < 0)
+            throw std::runtime_error(stdx::stdx_strerror("stdx::shard_executor::epoll_create1: "));
+        s->m_evfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = s->m_evfd;
+        if (s->m_evfd < 0 || ::epoll_ctl(s->m_epfd, EPOLL_CTL_ADD, s->m_evfd, &ev) != 0)
+            throw std::runtime_error(stdx::stdx_strerror("stdx::shard_executor::eventfd: "));
+
+        pthread_attr_t tattr;
+        pthread_attr_init(&tattr);
+        if (s->m_cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(s->m_cpu, &set);
+            pthread_attr_setaffinity_np(&tattr, sizeof(set), &set);
+        }
+
+        start_arg* arg = new start_arg;
+        arg->m_executor = this;
+        arg->m_shard = s;
+        int ret = pthread_create(&s->m_tid, &tattr, &shard_executor::routine, arg);
+        if (ret != 0 && s->m_cpu >= 0)
+        {
+            // CPU not in our cpuset (containers, taskset), run unpinned
+            s->m_cpu = -1;
+            ret = pthread_create(&s->m_tid, NULL, &shard_executor::routine, arg);
+        }
+        pthread_attr_destroy(&tattr);
+        if (ret != 0)
+        {
+            delete arg;
+            throw std::runtime_error(stdx::stdx_strerror("stdx::shard_executor::pthread_create: "));
+        }
+        s->m_started = true;
+    }
+
+public:
+    // One shard per online CPU when shards is 0. pin puts shard i on the
+    // i-th CPU of cpu_topology::spread(). ring_capacity is the size of
+    // every shard to shard ring.
+    explicit shard_executor(int shards = 0, bool pin = true, size_t ring_capacity = 256)
+        : m_ring_capacity(ring_capacity), m_stop(0), m_pushers(0)
+    {
+        cpu_topology topo;
+        if (shards <= 0)
+            shards = (int)topo.cpus().size();
+        if (shards <= 0)
+            shards = 1;
+        std::vector<int> cpus = topo.spread(shards);
+
+        for (int i = 0; i < shards; ++i)
+            m_shards.push_back(new shard(this, i, pin ? cpus[i] : -1, shards));
+        try
+        {
+            for (int i = 0; i < shards; ++i)
+                start(m_shards[i]);
+        }
+        catch (...)
+        {
+            stop();
+            for (size_t i = 0; i < m_shards.size(); ++i)
+                delete m_shards[i];
+            throw;
+        }
+    }
+
+    ~shard_executor()
+    {
+        stop();
+        for (size_t i = 0; i < m_shards.size(); ++i)
+            delete m_shards[i];
+    }
+
+    // Stops every shard after the task it is running; queued tasks are
+    // dropped (disposed when the executor goes away). Must not be called
+    // from a shard. Safe to call more than once.
+    void stop()
+    {
+        if (__atomic_exchange_n(&m_stop, 1, __ATOMIC_SEQ_CST) != 0)
+            return;
+        while (__atomic_load_n(&m_pushers, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            shard* s = m_shards[i];
+            if (!s->m_started)
+                continue;
+            uint64_t one = 1;
+            ssize_t ret = ::write(s->m_evfd, &one, sizeof(one));
+            (void)ret;
+            pthread_join(s->m_tid, NULL);
+            s->m_started = false;
+        }
+    }
+
+    int size() const
+    {
+        return (int)m_shards.size();
+    }
+
+    // CPU of shard index, -1 when it is not pinned
+    int cpu(int index) const
+    {
+        return m_shards[index]->m_cpu;
+    }
+
+    // tasks (and fd callbacks not counted) shard index has run
+    uint64_t executed(int index) const
+    {
+        return stat_load(m_shards[index]->m_executed);
+    }
+
+    // Queues f on shard index (0 <= index < size()). Returns false once
+    // stop() has started, unless called from a shard.
+    template <typename F>
+    bool push_to(int index, F f)
+    {
+        small_task task(f);
+        if (push_task(index, task))
+            return true;
+        task.dispose();
+        return false;
+    }
+
+    // Like push_to(), but hands back a future for f's result; invalid when
+    // rejected.
+    template <typename F>
+    future<typename task_result<F>::type> submit_to(int index, F f)
+    {
+        typedef typename task_result<F>::type R;
+        future<R> result;
+        if (!push_to(index, make_future_task(f, result)))
+        {
+            result.state()->release();
+            return future<R>();
+        }
+        return result;
+    }
+};
+
+namespace this_shard {
+
+// index of the calling shard, -1 outside any shard_executor
+inline int
+index()
+{
+    shard* s = current_shard();
+    return s != NULL ? s->m_index : -1;
+}
+
+// the calling shard's scratch arena, rewound after every task
+inline stdx::arena&
+arena()
+{
+    return this_worker::arena();
+}
+
+//
+// Calls f(revents) on the calling shard whenever fd is ready for events
+// (level triggered epoll events), until unwatch(fd). A second watch() of
+// the same fd replaces the callback. Shard threads only; throws
+// logic_error elsewhere and runtime_error when epoll_ctl fails.
+//
+template <typename F>
+inline void
+watch(int fd, uint32_t events, F f)
+{
+    shard* s = current_shard();
+    if (s == NULL)
+        throw std::logic_error("stdx::this_shard::watch: not on a shard");
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    std::map<int, shard_watch*>::iterator it = s->m_watches.find(fd);
+    int op = it == s->m_watches.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (::epoll_ctl(s->m_epfd, op, fd, &ev) != 0)
+        throw std::runtime_error(stdx::stdx_strerror("stdx::this_shard::watch: "));
+
+    shard_watch* w = new shard_watch_impl<F>(f);
+    if (it != s->m_watches.end())
+    {
+        s->m_retired.push_back(it->second);
+        it->second = w;
+    }
+    else
+    {
+        s->m_watches[fd] = w;
+    }
+}
+
+// Stops watching fd (call it before closing fd). Returns false if fd was
+// not watched by the calling shard.
+inline bool
+unwatch(int fd)
+{
+    shard* s = current_shard();
+    if (s == NULL)
+        return false;
+    std::map<int, shard_watch*>::iterator it = s->m_watches.find(fd);
+    if (it == s->m_watches.end())
+        return false;
+    ::epoll_ctl(s->m_epfd, EPOLL_CTL_DEL, fd, NULL);
+    s->m_retired.push_back(it->second);
+    s->m_watches.erase(it);
+    return true;
+}
+
+} // namespace this_shard
+
+} // namespace stdx
+
+
+#endif // __STDX_SHARD_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,140 @@
+#ifndef __STDX_SMALL_TASK_H
+#define __STDX_SMALL_TASK_H
+
+// C 89 header files
+#include <stddef.h>
+
+// C++ 98 header files
+#include <new>      // for placement new
+
+// stdx header files
+#include "stdx/stdx_memory.h"
+
+
+// Closures up to this size (and trivially copyable) are stored inside the
+// small_task itself, 56 bytes plus the call pointer fill one cache line.
+#ifndef STDX_TASK_INLINE_SIZE
+#define STDX_TASK_INLINE_SIZE   56
+#endif
+
+namespace stdx {
+
+// Called on a closure which is disposed instead of run. Does nothing;
+// closures which owe somebody an answer overload it (found by ADL), a
+// future_task breaks its promise.
+template <typename F>
+inline void
+task_disposed(F&)
+{ }
+
+union small_task_storage
+{
+    char m_buf[STDX_TASK_INLINE_SIZE];
+    void* m_ptr;
+    long long m_ll;
+    double m_d;
+};
+
+template <typename F,
+          bool _Inline = (sizeof(F) <= sizeof(small_task_storage)
+                          && __alignof__(F) <= __alignof__(small_task_storage)
+                          && __is_trivially_copyable(F))>
+struct small_task_impl
+{
+    static void store(small_task_storage& s, const F& f)
+    {
+        new(s.m_buf) F(f);
+    }
+
+    static void call(small_task_storage& s, bool brun)
+    {
+        // trivially destructible, nothing to release
+        if (brun)
+            (*reinterpret_cast<F*>(s.m_buf))();
+        else
+            task_disposed(*reinterpret_cast<F*>(s.m_buf));
+    }
+};
+
+template <typename F>
+struct small_task_impl<F, false>
+{
+    static void store(small_task_storage& s, const F& f)
+    {
+        s.m_ptr = new F(f);
+    }
+
+    static void call(small_task_storage& s, bool brun)
+    {
+        stdx::auto_delete<F> guard(static_cast<F*>(s.m_ptr));
+        if (brun)
+            (*guard)();
+        else
+            task_disposed(*guard);
+    }
+};
+
+//
+// Type erased, allocation free (for small closures) task.
+//
+// A small_task is copied bitwise, so it can sit by value in lock-free
+// queues. Copies share the one closure they were made from: exactly one
+// of them must be consumed with run() or dispose(), the others are just
+// forgotten. Closures which do not fit inline are moved to the heap.
+//
+class small_task
+{
+private:
+    void (*m_call)(small_task_storage&, bool);
+    small_task_storage m_storage;
+
+public:
+    small_task() : m_call(NULL)
+    { }
+
+    template <typename F>
+    explicit small_task(F f)
+    {
+        small_task_impl<F>::store(m_storage, f);
+        m_call = &small_task_impl<F>::call;
+    }
+
+    bool empty() const
+    {
+        return m_call == NULL;
+    }
+
+    // runs the closure and releases it
+    void run()
+    {
+        void (*call)(small_task_storage&, bool) = m_call;
+        m_call = NULL;
+        call(m_storage, true);
+    }
+
+    // releases the closure without running it, see task_disposed()
+    void dispose()
+    {
+        if (m_call != NULL)
+        {
+            void (*call)(small_task_storage&, bool) = m_call;
+            m_call = NULL;
+            call(m_storage, false);
+        }
+    }
+
+    template <typename F>
+    static bool is_inline()
+    {
+        return sizeof(F) <= sizeof(small_task_storage)
+            && __alignof__(F) <= __alignof__(small_task_storage)
+            && __is_trivially_copyable(F);
+    }
+};
+
+} // namespace stdx
+
+
+#endif // __STDX_SMALL_TASK_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
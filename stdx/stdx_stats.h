@@ -0,0 +1,263 @@
+#ifndef __STDX_STATS_H
+#define __STDX_STATS_H
+
+// Posix header files
+#include <sched.h>
+#include <unistd.h>
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_atomic.h"
+
+
+namespace stdx {
+
+// Adds v to a counter only the calling thread writes; other threads may
+// read it at any time with an atomic load. No lock prefix on the hot path.
+inline void
+stat_add(uint64_t& counter, uint64_t v = 1)
+{
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+inline uint64_t
+stat_load(const uint64_t& counter)
+{
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+// raises a counter written by many threads to at least v
+inline void
+stat_max(uint64_t& counter, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+    while (v > cur)
+    {
+        if (__atomic_compare_exchange_n(&counter, &cur, v, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+//
+// Counter bumped by many threads, e.g. requests served by any worker.
+//
+// One counter word on one cache line makes every increment steal that
+// line from the CPU which bumped it last. Here each CPU adds to a slot
+// of its own, padded to a cache line, so increments stay on a line the
+// CPU already owns; load() adds the slots up. The slot comes from
+// sched_getcpu(), which glibc 2.35 and later answer from the rseq area
+// the kernel keeps up to date, without a syscall. A thread moved to
+// another CPU between reading its number and adding is still counted
+// right, only on the other CPU's line, hence the (uncontended) atomic add.
+//
+// load() is not a snapshot: increments made while it runs may or may not
+// be in it. reset() races with add() the same way.
+//
+class sharded_counter : private noncopyable
+{
+private:
+    struct slot
+    {
+        uint64_t m_value;
+        char m_pad[STDX_CACHELINE_SIZE - sizeof(uint64_t)];
+    };
+
+    slot* m_slots;
+    unsigned m_mask;
+
+public:
+    // one slot per configured CPU (rounded up to a power of two), or the
+    // given number of slots
+    explicit sharded_counter(unsigned shards = 0) : m_slots(NULL), m_mask(0)
+    {
+        if (shards == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_CONF);
+            shards = cpus > 0 ? (unsigned)cpus : 1;
+        }
+        unsigned n = 1;
+        while (n < shards && n < 1024)
+            n <<= 1;
+
+        void* mem = NULL;
+        if (posix_memalign(&mem, STDX_CACHELINE_SIZE, n * sizeof(slot)) != 0)
+        {
+            throw std::runtime_error("posix_memalign");
+        }
+        memset(mem, 0, n * sizeof(slot));
+        m_slots = static_cast<slot*>(mem);
+        m_mask = n - 1;
+    }
+
+    ~sharded_counter()
+    {
+        free(m_slots);
+    }
+
+    void add(uint64_t v = 1)
+    {
+        int cpu = sched_getcpu();
+        __atomic_add_fetch(&m_slots[(unsigned)(cpu < 0 ? 0 : cpu) & m_mask].m_value,
+                           v, __ATOMIC_RELAXED);
+    }
+
+    // slots wrap around, their sum is still right
+    void sub(uint64_t v = 1)
+    {
+        add(0 - v);
+    }
+
+    uint64_t load() const
+    {
+        uint64_t sum = 0;
+        for (unsigned i = 0; i <= m_mask; ++i)
+            sum += __atomic_load_n(&m_slots[i].m_value, __ATOMIC_RELAXED);
+        return sum;
+    }
+
+    void reset()
+    {
+        for (unsigned i = 0; i <= m_mask; ++i)
+            __atomic_store_n(&m_slots[i].m_value, 0, __ATOMIC_RELAXED);
+    }
+
+    unsigned shards() const
+    {
+        return m_mask + 1;
+    }
+};
+
+//
+// HDR style histogram of 64-bit values (nanoseconds, usually).
+//
+// Values below 8 get a bucket each, above that every power of two is cut
+// into 8 linear sub-buckets, so a bucket is never wider than 1/8 of its
+// lower bound. record() is for one writing thread (see stat_add), any
+// thread may merge() a copy out of it while it is being written.
+//
+class latency_histogram
+{
+public:
+    enum { sub_bits = 3, sub_count = 1 << sub_bits };
+    enum { bucket_count = (64 - sub_bits + 1) * sub_count };
+
+private:
+    uint64_t m_counts[bucket_count];
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_max;
+
+public:
+    latency_histogram()
+    {
+        clear();
+    }
+
+    static size_t bucket_of(uint64_t v)
+    {
+        if (v < (uint64_t)sub_count)
+            return v;
+        unsigned msb = 63 - __builtin_clzll(v);
+        unsigned shift = msb - sub_bits;
+        return (msb - sub_bits + 1) * sub_count + ((v >> shift) & (sub_count - 1));
+    }
+
+    // smallest value which lands in bucket i
+    static uint64_t lower_bound(size_t i)
+    {
+        if (i < (size_t)sub_count)
+            return i;
+        unsigned shift = i / sub_count - 1;
+        return (uint64_t)(sub_count + i % sub_count) << shift;
+    }
+
+    // largest value which lands in bucket i
+    static uint64_t upper_bound(size_t i)
+    {
+        if (i < (size_t)sub_count)
+            return i;
+        return lower_bound(i) + ((uint64_t)1 << (i / sub_count - 1)) - 1;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < bucket_count; ++i)
+            m_counts[i] = 0;
+        m_total = m_sum = m_max = 0;
+    }
+
+    void record(uint64_t v)
+    {
+        stat_add(m_counts[bucket_of(v)]);
+        stat_add(m_total);
+        stat_add(m_sum, v);
+        if (v > stat_load(m_max))
+            __atomic_store_n(&m_max, v, __ATOMIC_RELAXED);
+    }
+
+    // adds other's counts to ours, other may be written concurrently
+    void merge(const latency_histogram& other)
+    {
+        for (size_t i = 0; i < bucket_count; ++i)
+            m_counts[i] += stat_load(other.m_counts[i]);
+        m_total += stat_load(other.m_total);
+        m_sum += stat_load(other.m_sum);
+        uint64_t mx = stat_load(other.m_max);
+        if (mx > m_max)
+            m_max = mx;
+    }
+
+    uint64_t count() const
+    {
+        return m_total;
+    }
+
+    uint64_t max() const
+    {
+        return m_max;
+    }
+
+    uint64_t mean() const
+    {
+        return m_total == 0 ? 0 : m_sum / m_total;
+    }
+
+    uint64_t bucket(size_t i) const
+    {
+        return m_counts[i];
+    }
+
+    // value at quantile q (0.5 median, 0.99 ...), the upper bound of its
+    // bucket (but never above the largest value recorded)
+    uint64_t percentile(double q) const
+    {
+        if (m_total == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(q * m_total + 0.5);
+        if (rank < 1)
+            rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += m_counts[i];
+            if (seen >= rank)
+                return upper_bound(i) < m_max ? upper_bound(i) : m_max;
+        }
+        return m_max;
+    }
+};
+
+} // namespace stdx
+
+
+#endif // __STDX_STATS_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -6,9 +6,17 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <netdb.h>
+#include <dirent.h>
+
+// C 89 header files
+#include <stdio.h>
+#include <stdlib.h>
 
 // C++ 98
-//#include <vector>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
 
 // stdx header files
 //#include "stdx_memory.h"
@@ -32,6 +40,135 @@ class pwlist
 };
 
 
+// parses a kernel cpu list ("0-3,8,10-11") into cpu numbers
+inline bool
+parse_cpulist(const std::string& str, std::vector<int>& cpus)
+{
+    const char* p = str.c_str();
+    while (*p != '\0' && *p != '\n')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return false;
+            p = end;
+        }
+        for (long c = first; c <= last; ++c)
+            cpus.push_back((int)c);
+        if (*p == ',')
+            ++p;
+    }
+    return true;
+}
+
+inline bool
+read_cpulist(const std::string& path, std::vector<int>& cpus)
+{
+    std::ifstream ifs(path.c_str());
+    std::string line;
+    if (!ifs || !std::getline(ifs, line))
+        return false;
+    return parse_cpulist(line, cpus);
+}
+
+//
+// Online CPUs and their NUMA nodes, from /sys/devices/system. Without
+// sysfs (or on a non NUMA kernel) every CPU is on node 0.
+//
+class cpu_topology
+{
+private:
+    std::vector<int> m_cpus;
+    std::vector<int> m_node_of;     // indexed by cpu number
+    int m_nodes;
+
+public:
+    cpu_topology() : m_nodes(1)
+    {
+        if (!read_cpulist("/sys/devices/system/cpu/online", m_cpus) || m_cpus.empty())
+        {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            for (long i = 0; i < (n > 0 ? n : 1); ++i)
+                m_cpus.push_back((int)i);
+        }
+        m_node_of.assign(*std::max_element(m_cpus.begin(), m_cpus.end()) + 1, 0);
+
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (dir == NULL)
+            return;
+
+        int max_node = 0;
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+            int node;
+            char tail;
+            if (sscanf(ent->d_name, "node%d%c", &node, &tail) != 1)
+                continue;
+
+            std::vector<int> cpus;
+            read_cpulist(std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist", cpus);
+            for (size_t i = 0; i < cpus.size(); ++i)
+            {
+                if (cpus[i] >= 0 && (size_t)cpus[i] < m_node_of.size())
+                    m_node_of[cpus[i]] = node;
+            }
+            max_node = std::max(max_node, node);
+        }
+        closedir(dir);
+        m_nodes = max_node + 1;
+    }
+
+    const std::vector<int>& cpus() const
+    {
+        return m_cpus;
+    }
+
+    int nodes() const
+    {
+        return m_nodes;
+    }
+
+    int node_of(int cpu) const
+    {
+        if (cpu < 0 || (size_t)cpu >= m_node_of.size())
+            return 0;
+        return m_node_of[cpu];
+    }
+
+    // n CPUs taken round robin from the nodes, so that workers spread over
+    // all sockets; wraps around when n exceeds the number of CPUs
+    std::vector<int> spread(size_t n) const
+    {
+        std::vector<std::vector<int> > by_node(m_nodes);
+        for (size_t i = 0; i < m_cpus.size(); ++i)
+            by_node[node_of(m_cpus[i])].push_back(m_cpus[i]);
+
+        std::vector<int> order;
+        for (size_t round = 0; order.size() < m_cpus.size(); ++round)
+        {
+            for (int node = 0; node < m_nodes; ++node)
+            {
+                if (round < by_node[node].size())
+                    order.push_back(by_node[node][round]);
+            }
+        }
+
+        std::vector<int> result;
+        for (size_t i = 0; i < n; ++i)
+            result.push_back(order[i % order.size()]);
+        return result;
+    }
+};
+
+
 } // namespace stdx
 
 
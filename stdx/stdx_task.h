@@ -3,13 +3,20 @@
 
 // Posix header files
 #include <pthread.h>
+#include <sched.h>
+
+// C 89 header files
+#include <stdint.h>
 
 // C++ 98 head file
 #include <list>
 #include <queue>
+#include <vector>
 
 // stdx header files
 #include "stdx/stdx_mutex.h"
+#include "stdx/stdx_queue.h"
+#include "stdx/stdx_small_task.h"
 
 
 namespace stdx {
@@ -31,38 +38,232 @@ private:
     F f;
 };
 
-class task_pool
+//
+// Pending tasks, stored by value as small_task.
+//
+// The default backing store is a set of FIFO lanes under one mutex, one
+// lane per priority level (a single lane unless asked for more). Level 0
+// is served first; a bitmap of non-empty lanes finds it in O(1). To keep
+// the other levels from starving, every share-th pop goes to the next
+// non-empty less urgent lane in turn (share 0: strict priorities).
+//
+// Constructed with a capacity the pool uses a lock-free mpmc_queue
+// instead: push() and pop() never take a lock, try_push() reports a full
+// queue to the caller, and priorities are ignored.
+//
+class task_pool : private noncopyable
 {
 private:
+    typedef std::queue<small_task> lane_type;
+
     mutex m_mutex;
-//  std::list<task_base*> m_tasks;
-    std::queue<task_base*> m_tasks;
+    std::vector<lane_type> m_lanes;
+    uint64_t m_nonempty;
+    size_t m_size;
+    unsigned m_share;
+    unsigned m_pops;
+    unsigned m_cursor;
+    mpmc_queue<small_task>* m_ring;
+
+    void init(size_t capacity, unsigned levels, unsigned share)
+    {
+        if (levels < 1)
+            levels = 1;
+        if (levels > max_levels)
+            levels = max_levels;
+        m_lanes.resize(levels);
+        m_nonempty = 0;
+        m_size = 0;
+        m_share = share;
+        m_pops = 0;
+        m_cursor = 0;
+        m_ring = capacity > 0 ? new mpmc_queue<small_task>(capacity) : NULL;
+    }
+
+    // caller holds m_mutex
+    void push_locked(const small_task& t, unsigned level)
+    {
+        if (level >= m_lanes.size())
+            level = m_lanes.size() - 1;
+        m_lanes[level].push(t);
+        __atomic_store_n(&m_nonempty, m_nonempty | (1ull << level), __ATOMIC_RELAXED);
+        __atomic_store_n(&m_size, m_size + 1, __ATOMIC_RELAXED);
+    }
+
+    // caller holds m_mutex
+    bool pop_locked(small_task& t)
+    {
+        uint64_t mask = m_nonempty;
+        if (mask == 0)
+            return false;
+
+        unsigned level = __builtin_ctzll(mask);
+        uint64_t others = mask & (mask - 1);
+        if (others != 0 && m_share > 0 && ++m_pops >= m_share)
+        {
+            // starvation protection, round robin over the less urgent lanes
+            m_pops = 0;
+            uint64_t after = others & (~0ull << m_cursor);
+            level = __builtin_ctzll(after != 0 ? after : others);
+            m_cursor = (level + 1) % max_levels;
+        }
+
+        lane_type& lane = m_lanes[level];
+        t = lane.front();
+        lane.pop();
+        __atomic_store_n(&m_size, m_size - 1, __ATOMIC_RELAXED);
+        if (lane.empty())
+            __atomic_store_n(&m_nonempty, mask & ~(1ull << level), __ATOMIC_RELAXED);
+        return true;
+    }
 
 public:
+    enum { max_levels = 64 };
+
+    task_pool()
+    {
+        init(0, 1, 0);
+    }
+
+    explicit task_pool(size_t capacity)
+    {
+        init(capacity, 1, 0);
+    }
+
+    task_pool(size_t capacity, unsigned levels, unsigned share)
+    {
+        init(capacity, levels, share);
+    }
+
+    ~task_pool()
+    {
+        small_task task;
+        while (pop(task))
+            task.dispose();
+        delete m_ring;
+    }
+
+    unsigned levels() const
+    {
+        return m_ring != NULL ? 1 : m_lanes.size();
+    }
+
+    // the least urgent level, where push() without a priority goes
+    unsigned default_level() const
+    {
+        return levels() - 1;
+    }
+
+    // waits for room when a bounded queue is full
+    void push(const small_task& t, unsigned level)
+    {
+        if (m_ring != NULL)
+        {
+            while (!m_ring->try_push(t))
+                sched_yield();
+            return;
+        }
+        lock_guard<mutex> guard(m_mutex);
+        push_locked(t, level);
+    }
+
+    void push(const small_task& t)
+    {
+        push(t, default_level());
+    }
+
     template <typename F>
     void push(F f)
     {
-        task<F>* t = new task<F>(f);
+        push(small_task(f), default_level());
+    }
+
+    // returns false when a bounded queue is full, t is left to the caller
+    bool try_push(const small_task& t)
+    {
+        if (m_ring == NULL)
+        {
+            push(t);
+            return true;
+        }
+        return m_ring->try_push(t);
+    }
+
+    template <typename F>
+    bool try_push(F f)
+    {
+        small_task t(f);
+        if (!try_push(t))
+        {
+            t.dispose();
+            return false;
+        }
+        return true;
+    }
+
+    // enqueues every closure in [first, last) under one lock (the
+    // lock-free ring has no lock and takes them one by one)
+    template <typename _InputIterator>
+    size_t push_bulk(_InputIterator first, _InputIterator last)
+    {
+        size_t n = 0;
+        if (m_ring != NULL)
+        {
+            for (; first != last; ++first, ++n)
+                push(small_task(*first));
+            return n;
+        }
+        unsigned level = default_level();
         lock_guard<mutex> guard(m_mutex);
-        m_tasks.push(t);
+        for (; first != last; ++first, ++n)
+            push_locked(small_task(*first), level);
+        return n;
     }
 
-    task_base* pop()
+    bool pop(small_task& task)
     {
+        if (m_ring != NULL)
+            return m_ring->try_pop(task);
+
         lock_guard<mutex> guard(m_mutex);
-        task_base* task = NULL;
-        if (!m_tasks.empty())
+        return pop_locked(task);
+    }
+
+    // dequeues up to max tasks into out, returns how many
+    size_t pop_bulk(small_task* out, size_t max)
+    {
+        size_t n = 0;
+        if (m_ring != NULL)
         {
-            task = m_tasks.front();
-            m_tasks.pop();
+            while (n < max && m_ring->try_pop(out[n]))
+                ++n;
+            return n;
         }
-        return task;
+        lock_guard<mutex> guard(m_mutex);
+        while (n < max && pop_locked(out[n]))
+            ++n;
+        return n;
     }
 
+    // no lock, cheap enough for spin loops
     bool empty()
     {
-        lock_guard<mutex> guard(m_mutex);
-        return m_tasks.empty();
+        if (m_ring != NULL)
+            return m_ring->empty();
+        return __atomic_load_n(&m_nonempty, __ATOMIC_RELAXED) == 0;
+    }
+
+    // number of queued tasks, no lock (so only a snapshot)
+    size_t size() const
+    {
+        if (m_ring != NULL)
+            return m_ring->size();
+        return __atomic_load_n(&m_size, __ATOMIC_RELAXED);
+    }
+
+    bool bounded() const
+    {
+        return m_ring != NULL;
     }
 };
 
@@ -3,14 +3,33 @@
 
 // Posix header files
 #include <pthread.h>
+#include <sched.h>
+
+// C 89 header files
+#include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
 
 // C++ 98 head file
+#include <iterator>
 #include <list>
+#include <vector>
 #include <iostream>
+#include <stdexcept>
 
 // stdx header files
 #include "stdx/stdx_noncopyable.h"
 #include "stdx/stdx_task.h"
+#include "stdx/stdx_queue.h"
+#include "stdx/stdx_atomic.h"
+#include "stdx/stdx_future.h"
+#include "stdx/stdx_futex.h"
+#include "stdx/stdx_sysinfo.h"
+#include "stdx/stdx_time.h"
+#include "stdx/stdx_stats.h"
+#include "stdx/stdx_timer.h"
+#include "stdx/stdx_arena.h"
 #include "stdx/stdx_string.h"
 
 
@@ -137,56 +156,770 @@ public:
 
 namespace stdx {
 
-struct thread_pool_data
+// How the workers of a thread_pool find their tasks.
+enum schedule_mode
+{
+    // all workers pop from one mutex protected task_pool
+    schedule_shared_queue,
+    // every worker owns a deque, idle workers steal from random victims
+    schedule_work_stealing
+};
+
+struct thread_pool_attr
+{
+    thread_pool_attr()
+        : m_mode(schedule_shared_queue), m_deque_capacity(1024),
+          m_queue_capacity(0), m_batch_size(1),
+          m_spin_count(0), m_yield_count(0), m_pin_workers(false),
+          m_priority_levels(1), m_priority_share(8),
+          m_min_threads(1), m_max_threads(0), m_grow_depth(16),
+          m_grow_wait_ms(5), m_keep_alive_ms(60000),
+          m_time_tasks(false)
+    { }
+
+    schedule_mode m_mode;
+    // per-worker deque size in schedule_work_stealing mode, a task pushed
+    // to a full deque goes to the shared queue instead
+    size_t m_deque_capacity;
+    // 0 keeps the unbounded mutex protected shared queue, anything else
+    // makes it a lock-free ring of (at least) that many slots
+    size_t m_queue_capacity;
+    // how many tasks a worker takes from the shared queue at once; in
+    // work stealing mode the extra ones go to its (stealable) deque.
+    // Ignored with priority lanes, which hand out one task at a time.
+    size_t m_batch_size;
+    // idle policy: a worker without work spins (up to m_spin_count rounds
+    // of cpu_relax, adapted to how often spinning found work), then calls
+    // sched_yield m_yield_count times, then parks on a futex. The defaults
+    // park at once.
+    unsigned m_spin_count;
+    unsigned m_yield_count;
+    // Pin every worker to one CPU: worker i gets m_cpus[i % size], or,
+    // when m_cpus is empty, a CPU from cpu_topology::spread() which deals
+    // workers round robin over the NUMA nodes. Pinned workers allocate
+    // their own deque (first touch keeps it on their node) and steal from
+    // workers on the same node first.
+    bool m_pin_workers;
+    std::vector<int> m_cpus;
+    // Priority lanes of the shared queue (at most task_pool::max_levels,
+    // 0 is the most urgent, push() without a priority uses the last one).
+    // Every m_priority_share-th dequeue serves a less urgent lane so it
+    // cannot starve, 0 makes priorities strict. Needs the mutex backed
+    // shared queue (m_queue_capacity 0).
+    unsigned m_priority_levels;
+    unsigned m_priority_share;
+    // Elastic mode, on when m_max_threads > 0: the pool keeps between
+    // m_min_threads and m_max_threads workers (the constructor's num is
+    // clamped into that range). A push that finds no idle worker spawns
+    // one when m_grow_depth tasks are queued or the queue has not been
+    // drained for m_grow_wait_ms; a worker parked for m_keep_alive_ms
+    // exits. thread_pool::scaling() counts these decisions.
+    int m_min_threads;
+    int m_max_threads;
+    size_t m_grow_depth;
+    int m_grow_wait_ms;
+    int m_keep_alive_ms;
+    // Record queue wait and run time of every task in the histograms of
+    // thread_pool::snapshot(). Costs two clock reads per task and 8 bytes
+    // of closure; the plain counters are always kept.
+    bool m_time_tasks;
+};
+
+// Per-worker statistics. Only the worker writes them (stat_add), so they
+// need no locked instructions; snapshot() reads them while it runs.
+struct thread_pool_counters
+{
+    thread_pool_counters()
+        : m_executed(0), m_steal_attempts(0), m_steals(0), m_idle_ns(0),
+          m_park_ns(0), m_parks(0), m_deque_hwm(0)
+    { }
+
+    // adds a concurrent reading of other to this (private) copy
+    void merge(const thread_pool_counters& other)
+    {
+        m_executed += stat_load(other.m_executed);
+        m_steal_attempts += stat_load(other.m_steal_attempts);
+        m_steals += stat_load(other.m_steals);
+        m_idle_ns += stat_load(other.m_idle_ns);
+        m_park_ns += stat_load(other.m_park_ns);
+        m_parks += stat_load(other.m_parks);
+        uint64_t hwm = stat_load(other.m_deque_hwm);
+        if (hwm > m_deque_hwm)
+            m_deque_hwm = hwm;
+        m_wait.merge(other.m_wait);
+        m_run.merge(other.m_run);
+    }
+
+    uint64_t m_executed;
+    uint64_t m_steal_attempts;  // steal() calls on other workers' deques
+    uint64_t m_steals;          // ... which got a task
+    uint64_t m_idle_ns;         // spinning and yielding without work
+    uint64_t m_park_ns;         // asleep on the futex
+    uint64_t m_parks;
+    uint64_t m_deque_hwm;       // most tasks seen on the own deque
+    latency_histogram m_wait;   // ns from push to start (m_time_tasks)
+    latency_histogram m_run;    // ns from start to end (m_time_tasks)
+};
+
+// Aggregated statistics of a thread_pool, see thread_pool::snapshot().
+struct thread_pool_stats
 {
-    thread_pool_data() : m_running(true)
+    thread_pool_stats()
+        : m_queue_depth(0), m_queue_hwm(0), m_submitted(0), m_rejected(0),
+          m_helped(0)
     { }
-    volatile bool m_running;
+
+    thread_pool_counters m_total;
+    // indexed by worker slot
+    std::vector<thread_pool_counters> m_workers;
+    uint64_t m_queue_depth;     // shared queue, now
+    uint64_t m_queue_hwm;       // shared queue, most tasks seen
+    uint64_t m_submitted;       // tasks accepted by the push functions
+    uint64_t m_rejected;        // ... turned away (shut down, ring full)
+    uint64_t m_helped;          // run by other threads in run_one()
+};
+
+struct thread_pool_data;
+
+struct thread_pool_worker : public cacheline_allocated, private noncopyable
+{
+    thread_pool_worker(thread_pool_data* pdata, int index, int cpu, int node,
+                       size_t capacity, size_t batch, unsigned spin)
+        : m_pdata(pdata), m_index(index), m_cpu(cpu), m_node(node),
+          m_seed(index * 2654435761u + 1),
+          m_deque(capacity), m_batch(batch),
+          m_spin_max(spin), m_spin_limit(spin)
+    { }
+
+    // xorshift, only used to pick steal victims
+    unsigned next_random()
+    {
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 17;
+        m_seed ^= m_seed << 5;
+        return m_seed;
+    }
+
+    // spinning paid off, allow longer spins again
+    void spin_succeeded()
+    {
+        m_spin_limit = m_spin_limit * 2 > m_spin_max ? m_spin_max : m_spin_limit * 2;
+    }
+
+    // spun for nothing, spin less next time (but never stop completely)
+    void spin_failed()
+    {
+        unsigned floor = m_spin_max > 16 ? m_spin_max / 16 : (m_spin_max > 0 ? 1 : 0);
+        m_spin_limit = m_spin_limit / 2 < floor ? floor : m_spin_limit / 2;
+    }
+
+    // runs a task, then gives back what it took from the arena
+    void run(small_task& task)
+    {
+        arena::position pos = m_arena.mark();
+        task.run();
+        m_arena.rewind(pos);
+    }
+
+    thread_pool_data* m_pdata;
+    int m_index;
+    int m_cpu;      // -1 when not pinned
+    int m_node;
+    unsigned m_seed;
+    stdx::work_stealing_deque<small_task> m_deque;
+    std::vector<small_task> m_batch;
+    unsigned m_spin_max;
+    unsigned m_spin_limit;
+    // scratch memory for the tasks, see this_worker::arena()
+    stdx::arena m_arena;
+    thread_pool_counters m_stats STDX_CACHELINE_ALIGNED;
+};
+
+// the pool worker running on the calling thread, NULL for other threads
+inline thread_pool_worker*&
+current_worker()
+{
+    static __thread thread_pool_worker* s_worker = NULL;
+    return s_worker;
+}
+
+namespace this_worker {
+
+inline void
+release_arena(void* arg)
+{
+    delete static_cast<stdx::arena*>(arg);
+}
+
+//
+// Scratch arena of the calling thread. On a pool worker everything a task
+// allocates here is freed when the task returns (a task run inside another
+// one, by fork_join for instance, only frees its own), so request scoped
+// data costs a pointer bump and never meets another thread in malloc.
+// Nothing may outlive the task. Other threads get an arena of their own
+// which they rewind themselves (arena_scope).
+//
+inline stdx::arena&
+arena()
+{
+    thread_pool_worker* self = current_worker();
+    if (self != NULL)
+        return self->m_arena;
+
+    static __thread stdx::arena* s_arena = NULL;
+    if (s_arena == NULL)
+    {
+        static pthread_key_t s_key;
+        static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+        struct key
+        {
+            static void make()
+            {
+                pthread_key_create(&s_key, &release_arena);
+            }
+        };
+        pthread_once(&s_once, &key::make);
+        s_arena = new stdx::arena();
+        pthread_setspecific(s_key, s_arena);
+    }
+    return *s_arena;
+}
+
+} // namespace this_worker
+
+// Wraps a task pushed with thread_pool_attr::m_time_tasks, records its
+// wait and run time in the executing worker's histograms.
+template <typename F>
+struct timed_task
+{
+    F m_func;
+    int64_t m_enqueued;
+
+    timed_task(const F& f, int64_t now) : m_func(f), m_enqueued(now)
+    { }
+
+    void operator()()
+    {
+        thread_pool_worker* self = current_worker();
+        int64_t start = stdx::monotonic_nsec();
+        m_func();
+        if (self != NULL)
+        {
+            self->m_stats.m_wait.record(start - m_enqueued);
+            self->m_stats.m_run.record(stdx::monotonic_nsec() - start);
+        }
+    }
+};
+
+template <typename F>
+inline void
+task_disposed(timed_task<F>& task)
+{
+    task_disposed(task.m_func);
+}
+
+// Life cycle of a thread_pool, it only ever moves forward.
+enum pool_state
+{
+    // accepts tasks from everybody
+    pool_running,
+    // shutdown() started: tasks from outside the pool are rejected, the
+    // workers (and tasks they push) go on
+    pool_closing,
+    // like closing, the last worker to find nothing left ends the drain
+    pool_draining,
+    // workers exit after their current task
+    pool_stopping
+};
+
+// What thread_pool::shutdown() does with queued tasks.
+enum drain_mode
+{
+    // run them all (and whatever they push), unless the deadline expires
+    drain_all,
+    // run none of them, hand them back to the caller
+    drain_none
+};
+
+// Counters of the elastic policy (thread_pool::scaling()).
+struct thread_pool_scaling
+{
+    thread_pool_scaling()
+        : m_threads(0), m_peak_threads(0), m_spawned(0), m_retired(0),
+          m_grow_by_depth(0), m_grow_by_wait(0), m_spawn_failed(0)
+    { }
+
+    int m_threads;              // workers running now
+    int m_peak_threads;
+    uint64_t m_spawned;         // workers started after construction
+    uint64_t m_retired;         // workers which exited after the keep-alive
+    uint64_t m_grow_by_depth;   // spawns because of queue depth
+    uint64_t m_grow_by_wait;    // spawns because the queue was not drained
+    uint64_t m_spawn_failed;
+};
+
+struct thread_pool_data
+{
+    thread_pool_data(int num, const thread_pool_attr& attr)
+        : m_state(pool_running), m_mode(attr.m_mode),
+          m_pool(attr.m_queue_capacity, attr.m_priority_levels, attr.m_priority_share),
+          m_batch_size(attr.m_batch_size > 0 ? attr.m_batch_size : 1),
+          m_deque_capacity(attr.m_mode == schedule_work_stealing ? attr.m_deque_capacity : 2),
+          m_spin_count(attr.m_spin_count), m_yield_count(attr.m_yield_count),
+          m_multi_node(false), m_detached(false),
+          m_elastic(attr.m_max_threads > 0),
+          m_min_threads(attr.m_min_threads), m_max_threads(attr.m_max_threads),
+          m_grow_depth(attr.m_grow_depth), m_grow_wait_ms(attr.m_grow_wait_ms),
+          m_keep_alive_ms(attr.m_keep_alive_ms),
+          m_last_drained_ms(0), m_last_grow_ms(0),
+          m_time_tasks(attr.m_time_tasks), m_queue_hwm(0),
+          m_live(0), m_pushers(0), m_idle(0), m_wake_seq(0)
+    {
+        if (!m_elastic)
+            m_min_threads = m_max_threads = num > 0 ? num : 0;
+        if (m_min_threads > m_max_threads)
+            m_min_threads = m_max_threads;
+
+        // one slot per possible worker; records stay until the pool dies,
+        // so a thief never looks at freed memory
+        m_workers.assign(m_max_threads, NULL);
+        m_slot_used.assign(m_max_threads, false);
+
+        cpu_topology topo;
+        std::vector<int> cpus;
+        if (attr.m_pin_workers)
+            cpus = attr.m_cpus.empty() ? topo.spread(m_max_threads) : attr.m_cpus;
+        for (int i = 0; i < m_max_threads; ++i)
+        {
+            m_slot_cpu.push_back(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+            m_slot_node.push_back(cpus.empty() ? 0 : topo.node_of(m_slot_cpu[i]));
+            if (m_slot_node[i] != m_slot_node[0])
+                m_multi_node = true;
+        }
+    }
+
+    ~thread_pool_data()
+    {
+        for (size_t i = 0; i < m_workers.size(); ++i)
+        {
+            if (m_workers[i] == NULL)
+                continue;
+            small_task task;
+            while (m_workers[i]->m_deque.pop(task))
+                task.dispose();
+            delete m_workers[i];
+        }
+    }
+
+    int m_state;                // pool_state
+    schedule_mode m_mode;
     stdx::task_pool m_pool;
-    stdx::mutex m_mutex;
-    stdx::condition_variable m_cond;
+    // indexed by slot, NULL until a thread first runs in the slot
+    std::vector<thread_pool_worker*> m_workers;
+    size_t m_batch_size;
+    size_t m_deque_capacity;
+    unsigned m_spin_count;
+    unsigned m_yield_count;
+    // workers sit on more than one NUMA node
+    bool m_multi_node;
+    std::vector<int> m_slot_cpu;
+    std::vector<int> m_slot_node;
+
+    // thread bookkeeping, guarded by m_threads_mutex
+    stdx::mutex m_threads_mutex;
+    std::list<pthread_t> m_tids;
+    std::vector<bool> m_slot_used;
+    bool m_detached;
+
+    // elastic policy, see thread_pool_attr
+    bool m_elastic;
+    int m_min_threads;
+    int m_max_threads;
+    size_t m_grow_depth;
+    int m_grow_wait_ms;
+    int m_keep_alive_ms;
+    int64_t m_last_drained_ms;
+    int64_t m_last_grow_ms;
+    thread_pool_scaling m_scaling;
+
+    bool m_time_tasks;
+    uint64_t m_queue_hwm;
+    // bumped by any thread that pushes, hence one slot per CPU
+    stdx::sharded_counter m_submitted;
+    stdx::sharded_counter m_rejected;
+    stdx::sharded_counter m_helped;
+
+    // worker threads not exited yet, futex word for shutdown()
+    int m_live;
+    // threads from outside inside push(), see thread_pool::push_guard
+    int m_pushers STDX_CACHELINE_ALIGNED;
+    // number of workers parked (or about to park) on m_wake_seq
+    int m_idle STDX_CACHELINE_ALIGNED;
+    // futex word, bumped by every wakeup
+    int m_wake_seq;
+
+    pool_state state() const
+    {
+        return (pool_state)__atomic_load_n(&m_state, __ATOMIC_SEQ_CST);
+    }
+
+    // moves from `from` to `to`, fails if somebody else moved first
+    bool transition(pool_state from, pool_state to)
+    {
+        int expected = from;
+        if (!__atomic_compare_exchange_n(&m_state, &expected, (int)to, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return false;
+        stdx::futex_wake(&m_state);
+        return true;
+    }
+
+    // any state before pool_stopping goes to pool_stopping
+    void stop()
+    {
+        int cur = __atomic_load_n(&m_state, __ATOMIC_SEQ_CST);
+        while (cur < pool_stopping && !transition((pool_state)cur, pool_stopping))
+            cur = __atomic_load_n(&m_state, __ATOMIC_SEQ_CST);
+        wakeup_all();
+    }
+
+    // A cancelled worker (thread_pool::cancel) leaves from wherever it was,
+    // give its slot back like retire() does.
+    void cancelled(thread_pool_worker* self)
+    {
+        {
+            stdx::lock_guard<stdx::mutex> guard(m_threads_mutex);
+            m_slot_used[self->m_index] = false;
+            __atomic_store_n(&m_scaling.m_threads, m_scaling.m_threads - 1, __ATOMIC_SEQ_CST);
+        }
+        current_worker() = NULL;
+        exited();
+        // one worker less to wait for, the parked ones check the drain again
+        if (state() == pool_draining)
+            wakeup_all();
+    }
+
+    // A worker thread leaves, the last one wakes shutdown(). With no
+    // worker left a drain is over, whatever is still queued stays there.
+    void exited()
+    {
+        if (__atomic_sub_fetch(&m_live, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            stdx::futex_wake(&m_live);
+            transition(pool_draining, pool_stopping);
+        }
+    }
+
+    thread_pool_worker* worker_at(size_t slot) const
+    {
+        return __atomic_load_n(&m_workers[slot], __ATOMIC_ACQUIRE);
+    }
+
+    bool has_work()
+    {
+        if (!m_pool.empty())
+            return true;
+        if (m_mode == schedule_work_stealing)
+        {
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                thread_pool_worker* w = worker_at(i);
+                if (w != NULL && !w->m_deque.empty())
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Called by a worker which found nothing to do. Spins with cpu_relax()
+    // (for the worker's adaptive budget, at most m_spin_count rounds), then
+    // yields m_yield_count times, then sleeps on the m_wake_seq futex.
+    // It announces itself in m_idle before the last look at the queues, so
+    // a pusher that misses m_idle has published its task already.
+    // Returns false when an elastic pool retires the worker.
+    bool idle(thread_pool_worker* self)
+    {
+        if (m_elastic)
+            __atomic_store_n(&m_last_drained_ms, stdx::monotonic_msec(), __ATOMIC_RELAXED);
+
+        thread_pool_counters& stats = self->m_stats;
+        int64_t start = stdx::monotonic_nsec();
+
+        for (unsigned i = 0; i < self->m_spin_limit; ++i)
+        {
+            if (has_work())
+            {
+                self->spin_succeeded();
+                stat_add(stats.m_idle_ns, stdx::monotonic_nsec() - start);
+                return true;
+            }
+            stdx::cpu_relax();
+        }
+
+        for (unsigned i = 0; i < m_yield_count; ++i)
+        {
+            if (has_work())
+            {
+                stat_add(stats.m_idle_ns, stdx::monotonic_nsec() - start);
+                return true;
+            }
+            sched_yield();
+        }
+
+        self->spin_failed();
+        int64_t park = stdx::monotonic_nsec();
+        stat_add(stats.m_idle_ns, park - start);
+
+        struct timespec keep_alive = { m_keep_alive_ms / 1000, (m_keep_alive_ms % 1000) * 1000000L };
+        bool timed_out = false;
+
+        int seq = __atomic_load_n(&m_wake_seq, __ATOMIC_ACQUIRE);
+        int idle = __atomic_add_fetch(&m_idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pool_state st = state();
+        if (st == pool_draining && idle >= __atomic_load_n(&m_scaling.m_threads, __ATOMIC_SEQ_CST)
+            && !has_work())
+        {
+            // Every worker is in here and nothing is queued. Idle workers
+            // run no tasks, so nothing can be pushed any more: drained.
+            if (transition(pool_draining, pool_stopping))
+                wakeup_all();
+        }
+        else if (st < pool_stopping && !has_work())
+        {
+            stat_add(stats.m_parks);
+            int ret = stdx::futex_wait(&m_wake_seq, seq, m_elastic ? &keep_alive : NULL);
+            timed_out = ret == -1 && errno == ETIMEDOUT;
+            stat_add(stats.m_park_ns, stdx::monotonic_nsec() - park);
+        }
+        __atomic_sub_fetch(&m_idle, 1, __ATOMIC_SEQ_CST);
+
+        // futex_wait is no cancellation point, thread_pool::cancel wakes
+        // us up to get here
+        pthread_testcancel();
+
+        return !(timed_out && retire(self));
+    }
+
+    // An elastic worker idle for the keep-alive leaves, unless that would
+    // take the pool below m_min_threads. Nobody joins it, so it detaches.
+    bool retire(thread_pool_worker* self)
+    {
+        stdx::lock_guard<stdx::mutex> guard(m_threads_mutex);
+        if (state() != pool_running || m_scaling.m_threads <= m_min_threads || !self->m_deque.empty())
+            return false;
+
+        pthread_t tid = pthread_self();
+        for (std::list<pthread_t>::iterator it = m_tids.begin(); it != m_tids.end(); ++it)
+        {
+            if (pthread_equal(*it, tid))
+            {
+                m_tids.erase(it);
+                break;
+            }
+        }
+        if (!m_detached)
+            pthread_detach(tid);
+
+        m_slot_used[self->m_index] = false;
+        __atomic_store_n(&m_scaling.m_threads, m_scaling.m_threads - 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m_scaling.m_retired, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // Wakes min(n, idle) parked workers; no syscall when nobody is parked.
+    // Returns how many were parked.
+    int wakeup(size_t n)
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int idle = __atomic_load_n(&m_idle, __ATOMIC_SEQ_CST);
+        if (idle <= 0 || n == 0)
+            return idle;
+
+        __atomic_add_fetch(&m_wake_seq, 1, __ATOMIC_RELEASE);
+        stdx::futex_wake(&m_wake_seq, n >= (size_t)idle ? INT_MAX : (int)n);
+        return idle;
+    }
+
+    void wakeup_all()
+    {
+        __atomic_add_fetch(&m_wake_seq, 1, __ATOMIC_SEQ_CST);
+        stdx::futex_wake(&m_wake_seq, INT_MAX);
+    }
+
+    // local deque first, then the shared queue, then the other workers.
+    // With priority lanes the shared queue goes first, one task at a time:
+    // a batch would mix levels, and its rest would wait on the deque behind
+    // newer urgent work (or go back to the least urgent lane).
+    bool find_task(thread_pool_worker* self, small_task& task)
+    {
+        bool lanes = m_pool.levels() > 1;
+        if (!lanes && self->m_deque.pop(task))
+            return true;
+
+        size_t n = m_pool.pop_bulk(&self->m_batch[0], lanes ? 1 : self->m_batch.size());
+        if (n > 0)
+        {
+            // keep the rest of the batch where idle workers can steal it
+            for (size_t i = 1; i < n; ++i)
+            {
+                if (!self->m_deque.push(self->m_batch[i]))
+                    m_pool.push(self->m_batch[i]);
+            }
+            if (n > 1)
+                wakeup(n - 1);
+            task = self->m_batch[0];
+            return true;
+        }
+
+        if (lanes && self->m_deque.pop(task))
+            return true;
+
+        size_t num = m_workers.size();
+        if (num > 1)
+        {
+            // victims on our own node first, their tasks' data is closer
+            size_t start = self->next_random() % num;
+            uint64_t attempts = 0;
+            for (int pass = 0; pass < (m_multi_node ? 2 : 1); ++pass)
+            {
+                for (size_t i = 0; i < num; ++i)
+                {
+                    thread_pool_worker* victim = worker_at((start + i) % num);
+                    if (victim == NULL || victim == self
+                        || (m_multi_node && (victim->m_node == self->m_node) != (pass == 0)))
+                        continue;
+                    ++attempts;
+                    if (victim->m_deque.steal(task))
+                    {
+                        stat_add(self->m_stats.m_steal_attempts, attempts);
+                        stat_add(self->m_stats.m_steals);
+                        return true;
+                    }
+                }
+            }
+            stat_add(self->m_stats.m_steal_attempts, attempts);
+        }
+        return false;
+    }
+
+    // for threads which are not work stealing workers
+    bool steal_any(small_task& task)
+    {
+        if (m_mode != schedule_work_stealing)
+            return false;
+        for (size_t i = 0; i < m_workers.size(); ++i)
+        {
+            thread_pool_worker* victim = worker_at(i);
+            if (victim != NULL && victim->m_deque.steal(task))
+                return true;
+        }
+        return false;
+    }
 };
 
+// what a new worker thread needs to set itself up
+struct thread_pool_start
+{
+    thread_pool_data* m_pdata;
+    int m_index;
+    int m_cpu;
+};
+
+// Runs first on every worker thread. A new slot's record and deque are
+// allocated here, on the worker itself, so that they are local to the CPU
+// it may be pinned to; a slot left by a retired worker is reused.
+inline thread_pool_worker*
+thread_pool_enter(void* arg)
+{
+    thread_pool_start* start = static_cast<thread_pool_start*>(arg);
+    thread_pool_data* pdata = start->m_pdata;
+    int index = start->m_index;
+
+    thread_pool_worker* self = pdata->worker_at(index);
+    if (self == NULL)
+    {
+        self = new thread_pool_worker(
+                pdata, index, start->m_cpu, pdata->m_slot_node[index],
+                pdata->m_deque_capacity, pdata->m_batch_size, pdata->m_spin_count);
+        __atomic_store_n(&pdata->m_workers[index], self, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        self->m_cpu = start->m_cpu;
+        self->m_spin_limit = self->m_spin_max;
+    }
+    current_worker() = self;
+
+    delete start;
+    return self;
+}
+
 } // namespace stdx
 
 namespace
 {
     extern "C"
     {
-        inline void thread_cleanup_routine(void* arg)
+        // cleanup handler, only runs when the worker is cancelled
+        inline void thread_pool_cancelled(void* arg)
         {
-            stdx::thread_pool_data* pdata = static_cast<stdx::thread_pool_data*>(arg);
-            stdx::mutex& mtx = pdata->m_mutex;
-            mtx.unlock();
+            stdx::thread_pool_worker* self = static_cast<stdx::thread_pool_worker*>(arg);
+            self->m_pdata->cancelled(self);
         }
 
         inline void* thread_pool_routine(void* arg)
         {
-            pthread_cleanup_push(thread_cleanup_routine, arg);
-
-            stdx::thread_pool_data* pdata = static_cast<stdx::thread_pool_data*>(arg);
+            stdx::thread_pool_worker* self = stdx::thread_pool_enter(arg);
+            stdx::thread_pool_data* pdata = self->m_pdata;
             stdx::task_pool& pool = pdata->m_pool;
-            stdx::condition_variable& cond = pdata->m_cond;
-            stdx::mutex& mtx = pdata->m_mutex;
+            std::vector<stdx::small_task>& batch = self->m_batch;
 
-            while (pdata->m_running)
+            pthread_cleanup_push(thread_pool_cancelled, self);
+            while (pdata->state() < stdx::pool_stopping)
             {
-                stdx::task_base* ptask = pool.pop();
-                if (ptask != NULL)
+                size_t n = pool.pop_bulk(&batch[0], batch.size());
+                if (n > 0)
                 {
-                    ptask->run();
-                    delete ptask;
+                    for (size_t i = 0; i < n; ++i)
+                        self->run(batch[i]);
+                    stdx::stat_add(self->m_stats.m_executed, n);
                 }
-                else
+                else if (!pdata->idle(self))
                 {
-                    mtx.lock();
-                    cond.wait(mtx);
-                    mtx.unlock();
+                    break;
                 }
             }
+            pthread_cleanup_pop(0);
+
+            stdx::current_worker() = NULL;
+            pdata->exited();
+            return 0;
+        }
 
+        inline void* thread_pool_steal_routine(void* arg)
+        {
+            stdx::thread_pool_worker* self = stdx::thread_pool_enter(arg);
+            stdx::thread_pool_data* pdata = self->m_pdata;
+
+            pthread_cleanup_push(thread_pool_cancelled, self);
+            while (pdata->state() < stdx::pool_stopping)
+            {
+                stdx::small_task task;
+                if (pdata->find_task(self, task))
+                {
+                    self->run(task);
+                    stdx::stat_add(self->m_stats.m_executed);
+                }
+                else if (!pdata->idle(self))
+                {
+                    break;
+                }
+            }
             pthread_cleanup_pop(0);
 
+            stdx::current_worker() = NULL;
+            pdata->exited();
             return 0;
         }
     }
@@ -200,53 +933,623 @@ private:
     typedef std::list<pthread_t>    threadid_list;
 
     thread_pool_data m_data;
-    std::list<pthread_t> m_tids;
+    // started by the first schedule_after()/schedule_every()
+    timer_wheel* m_timers;
+
+    static bool dispatch_timer(void* ctx, const timer_fire& fire)
+    {
+        return static_cast<thread_pool*>(ctx)->push(fire);
+    }
+
+    // the wheel, started on first use; NULL once the pool stops
+    timer_wheel* timers()
+    {
+        timer_wheel* timers = __atomic_load_n(&m_timers, __ATOMIC_ACQUIRE);
+        if (timers == NULL)
+        {
+            stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+            timers = m_timers;
+            if (timers == NULL && m_data.state() == pool_running)
+            {
+                timers = new timer_wheel(&thread_pool::dispatch_timer, this);
+                __atomic_store_n(&m_timers, timers, __ATOMIC_RELEASE);
+            }
+        }
+        return timers;
+    }
+
+    // after the pool left pool_running, so no wheel is started any more
+    void stop_timers()
+    {
+        timer_wheel* timers;
+        {
+            stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+            timers = m_timers;
+        }
+        if (timers != NULL)
+            timers->stop();
+    }
+
+    // starts a worker in a free slot, caller holds m_threads_mutex
+    bool spawn(int slot)
+    {
+        thread_pool_start* start = new thread_pool_start;
+        start->m_pdata = &m_data;
+        start->m_index = slot;
+        start->m_cpu = m_data.m_slot_cpu[slot];
+
+        pthread_attr_t tattr;
+        pthread_attr_init(&tattr);
+        if (start->m_cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(start->m_cpu, &set);
+            pthread_attr_setaffinity_np(&tattr, sizeof(set), &set);
+        }
+
+        void* (*routine)(void*) = m_data.m_mode == schedule_work_stealing
+                                  ? thread_pool_steal_routine : thread_pool_routine;
+        pthread_t pid;
+        __atomic_add_fetch(&m_data.m_live, 1, __ATOMIC_SEQ_CST);
+        int ret = pthread_create(&pid, &tattr, routine, start);
+        if (ret != 0 && start->m_cpu >= 0)
+        {
+            // CPU not in our cpuset (containers, taskset), run unpinned
+            start->m_cpu = -1;
+            ret = pthread_create(&pid, NULL, routine, start);
+        }
+        pthread_attr_destroy(&tattr);
+        if (ret != 0)
+        {
+            m_data.exited();
+            delete start;
+            return false;
+        }
+        if (m_data.m_detached)
+            pthread_detach(pid);
+
+        m_data.m_tids.push_back(pid);
+        m_data.m_slot_used[slot] = true;
+        thread_pool_scaling& sc = m_data.m_scaling;
+        __atomic_store_n(&sc.m_threads, sc.m_threads + 1, __ATOMIC_RELAXED);
+        if (sc.m_threads > sc.m_peak_threads)
+            __atomic_store_n(&sc.m_peak_threads, sc.m_threads, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void start(int num)
+    {
+        if (num < m_data.m_min_threads)
+            num = m_data.m_min_threads;
+        if (num > m_data.m_max_threads)
+            num = m_data.m_max_threads;
+
+        stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+        for (int i = 0; i < num; ++i)
+        {
+            if (!spawn(i))
+                throw std::runtime_error(stdx::stdx_strerror("stdx::thread_pool::pthread_create: "));
+        }
+    }
+
+    // Elastic pools add a worker when nobody was idle to take a push and
+    // the backlog is deep (m_grow_depth tasks) or has not been drained for
+    // m_grow_wait_ms; at most one spawn per m_grow_wait_ms.
+    void grow()
+    {
+        thread_pool_scaling& sc = m_data.m_scaling;
+        int threads = __atomic_load_n(&sc.m_threads, __ATOMIC_RELAXED);
+        if (m_data.state() != pool_running || threads >= m_data.m_max_threads)
+            return;
+
+        size_t depth = m_data.m_pool.size();
+        int64_t now = stdx::monotonic_msec();
+        bool by_depth = depth >= m_data.m_grow_depth;
+        bool by_wait = depth > 0
+            && now - __atomic_load_n(&m_data.m_last_drained_ms, __ATOMIC_RELAXED) >= m_data.m_grow_wait_ms;
+        if (threads > 0)
+        {
+            if (!by_depth && !by_wait)
+                return;
+            if (now - __atomic_load_n(&m_data.m_last_grow_ms, __ATOMIC_RELAXED) < m_data.m_grow_wait_ms)
+                return;
+        }
+
+        if (!m_data.m_threads_mutex.try_lock())
+            return;
+
+        if (m_data.state() == pool_running && sc.m_threads < m_data.m_max_threads)
+        {
+            int slot = 0;
+            while (m_data.m_slot_used[slot])
+                ++slot;
+            if (spawn(slot))
+            {
+                __atomic_add_fetch(by_depth ? &sc.m_grow_by_depth : &sc.m_grow_by_wait, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&sc.m_spawned, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&m_data.m_last_grow_ms, now, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                __atomic_add_fetch(&sc.m_spawn_failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+        m_data.m_threads_mutex.unlock();
+    }
+
+    // wakes parked workers for n new tasks, grows an elastic pool when
+    // none were parked
+    void signal(size_t n)
+    {
+        if (m_data.wakeup(n) <= 0 && m_data.m_elastic)
+            grow();
+    }
+
+    // the calling thread's deque, if it is one of our work stealing workers
+    thread_pool_worker* local_worker()
+    {
+        thread_pool_worker* self = current_worker();
+        if (self != NULL && self->m_pdata == &m_data
+            && m_data.m_mode == schedule_work_stealing)
+            return self;
+        return NULL;
+    }
+
+    // Admission for the push functions. Our own workers may always push (a
+    // draining pool runs whatever its tasks push), other threads only while
+    // the pool is running. Those are counted in m_pushers, so shutdown()
+    // can wait for every push it did not reject to be queued.
+    class push_guard
+    {
+    private:
+        thread_pool_data& m_data;
+        bool m_counted;
+        bool m_accepted;
+
+    public:
+        explicit push_guard(thread_pool_data& data)
+            : m_data(data), m_counted(false), m_accepted(true)
+        {
+            thread_pool_worker* self = current_worker();
+            if (self != NULL && self->m_pdata == &data)
+                return;
+            m_counted = true;
+            __atomic_add_fetch(&data.m_pushers, 1, __ATOMIC_SEQ_CST);
+            m_accepted = data.state() == pool_running;
+        }
+
+        ~push_guard()
+        {
+            if (m_counted)
+                __atomic_sub_fetch(&m_data.m_pushers, 1, __ATOMIC_SEQ_CST);
+        }
+
+        bool accepted() const
+        {
+            return m_accepted;
+        }
+    };
+
+    // stamps f for the histograms when the pool times its tasks
+    template <typename F>
+    small_task make_task(F f)
+    {
+        if (m_data.m_time_tasks)
+            return small_task(timed_task<F>(f, stdx::monotonic_nsec()));
+        return small_task(f);
+    }
+
+    // self is local_worker(), the only writer of its deque and counters
+    bool push_local(thread_pool_worker* self, const small_task& task)
+    {
+        if (!self->m_deque.push(task))
+            return false;
+        uint64_t depth = self->m_deque.size();
+        if (depth > stat_load(self->m_stats.m_deque_hwm))
+            __atomic_store_n(&self->m_stats.m_deque_hwm, depth, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void shared_pushed()
+    {
+        stat_max(m_data.m_queue_hwm, m_data.m_pool.size());
+    }
+
+    template <typename _InputIterator>
+    size_t push_range(_InputIterator first, _InputIterator last)
+    {
+        size_t n = 0;
+        thread_pool_worker* self = local_worker();
+        if (self != NULL)
+        {
+            for (; first != last; ++first)
+            {
+                small_task task(*first);
+                ++n;
+                if (!push_local(self, task))
+                {
+                    // deque full, the rest goes to the shared queue
+                    m_data.m_pool.push(task);
+                    ++first;
+                    break;
+                }
+            }
+        }
+        n += m_data.m_pool.push_bulk(first, last);
+        shared_pushed();
+        m_data.m_submitted.add(n);
+        signal(n);
+        return n;
+    }
 
 public:
     thread_pool(int num, bool bdetach = true)
+        : m_data(num, thread_pool_attr()), m_timers(NULL)
+    {
+        start(num);
+    }
+
+    thread_pool(int num, const thread_pool_attr& attr)
+        : m_data(num, attr), m_timers(NULL)
     {
-        while (num-- > 0)
+        start(num);
+    }
+
+    ~thread_pool()
+    {
+        delete m_timers;
+    }
+
+    // In work stealing mode a task pushed from one of our own workers
+    // stays on that worker's deque, anything else goes to the shared queue.
+    // Returns false (and drops f) once shutdown() has started, unless
+    // called from one of our own workers.
+    template <typename F>
+    bool push(F f)
+    {
+        push_guard guard(m_data);
+        if (!guard.accepted())
+        {
+            m_data.m_rejected.add();
+            return false;
+        }
+
+        m_data.m_submitted.add();
+        small_task task = make_task(f);
+        thread_pool_worker* self = local_worker();
+        if (self == NULL || !push_local(self, task))
+        {
+            m_data.m_pool.push(task);
+            shared_pushed();
+        }
+        signal(1);
+        return true;
+    }
+
+    // Queues f at the given priority level (see thread_pool_attr), always
+    // through the shared queue.
+    template <typename F>
+    bool push(F f, unsigned priority)
+    {
+        push_guard guard(m_data);
+        if (!guard.accepted())
+        {
+            m_data.m_rejected.add();
+            return false;
+        }
+
+        m_data.m_submitted.add();
+        m_data.m_pool.push(make_task(f), priority);
+        shared_pushed();
+        signal(1);
+        return true;
+    }
+
+    // Like push(), but gives up instead of waiting when the shared queue
+    // is a full lock-free ring (thread_pool_attr::m_queue_capacity).
+    template <typename F>
+    bool try_push(F f)
+    {
+        push_guard guard(m_data);
+        if (!guard.accepted())
+        {
+            m_data.m_rejected.add();
+            return false;
+        }
+
+        small_task task = make_task(f);
+        thread_pool_worker* self = local_worker();
+        if (self == NULL || !push_local(self, task))
+        {
+            if (!m_data.m_pool.try_push(task))
+            {
+                task.dispose();
+                m_data.m_rejected.add();
+                return false;
+            }
+            shared_pushed();
+        }
+        m_data.m_submitted.add();
+        signal(1);
+        return true;
+    }
+
+    // Like push(), but hands back a future for f's result. Wait on many of
+    // them at once with when_all()/when_any(). A rejected task gives an
+    // invalid future.
+    template <typename F>
+    future<typename task_result<F>::type> submit(F f)
+    {
+        typedef typename task_result<F>::type R;
+        future<R> result;
+        if (!push(make_future_task(f, result)))
         {
-            pthread_t pid;
-            int ret = pthread_create(&pid, NULL, thread_pool_routine, &m_data);
-            assert(ret == 0);
-            m_tids.push_back(pid);
+            // the reference the task would have dropped after running
+            result.state()->release();
+            return future<R>();
         }
+        return result;
     }
 
+    // Pushes every closure in [first, last) with one queue operation and
+    // wakes min(N, idle) workers, returns N (0 when rejected like push()).
+    template <typename _InputIterator>
+    size_t push_bulk(_InputIterator first, _InputIterator last)
+    {
+        push_guard guard(m_data);
+        if (!guard.accepted())
+        {
+            m_data.m_rejected.add(std::distance(first, last));
+            return 0;
+        }
+
+        if (!m_data.m_time_tasks)
+            return push_range(first, last);
+
+        std::vector<small_task> tasks;
+        for (; first != last; ++first)
+            tasks.push_back(make_task(*first));
+        return push_range(tasks.begin(), tasks.end());
+    }
+
+    // Pushes f after delay_ms. Timers live in a timing wheel driven by
+    // one thread, so waiting costs no worker; insert and cancel are O(1).
+    // Like push(), rejects f once shutdown has started: the id is invalid.
+    template <typename F>
+    timer_id schedule_after(int delay_ms, F f)
+    {
+        timer_wheel* wheel = state() == pool_running ? timers() : NULL;
+        return wheel != NULL ? wheel->add(delay_ms, 0, f) : timer_id();
+    }
+
+    // Pushes f every period_ms, the first time after one period. A run
+    // still queued or running when the next one is due skips that one.
     template <typename F>
-    void push(F f)
+    timer_id schedule_every(int period_ms, F f)
+    {
+        timer_wheel* wheel = state() == pool_running ? timers() : NULL;
+        return wheel != NULL ? wheel->add(period_ms, period_ms, f) : timer_id();
+    }
+
+    // Returns true if the timer was pending; it does not fire (again)
+    // then, but a run already pushed to the pool still happens.
+    bool cancel_timer(const timer_id& id)
+    {
+        timer_wheel* timers = __atomic_load_n(&m_timers, __ATOMIC_ACQUIRE);
+        return timers != NULL && timers->cancel(id);
+    }
+
+    // Runs one queued task on the calling thread, returns false if there
+    // was none. A thread waiting for tasks it pushed itself (fork/join in
+    // stdx_parallel.h) helps with them instead of blocking; for a worker
+    // that is what keeps the pool from deadlocking.
+    bool run_one()
     {
-        m_data.m_pool.push(f);
-        m_data.m_cond.notify_one();
+        small_task task;
+        thread_pool_worker* self = local_worker();
+        if (self != NULL)
+        {
+            if (!m_data.find_task(self, task))
+                return false;
+            self->run(task);
+            stat_add(self->m_stats.m_executed);
+            return true;
+        }
+        if (!m_data.m_pool.pop(task) && !m_data.steal_any(task))
+            return false;
+        arena_scope scope(this_worker::arena());
+        task.run();
+        m_data.m_helped.add();
+        return true;
+    }
+
+    // the calling thread is one of our workers
+    bool is_worker() const
+    {
+        thread_pool_worker* self = current_worker();
+        return self != NULL && self->m_pdata == &m_data;
+    }
+
+    // tasks waiting on the calling worker's own deque (0 for other threads
+    // and in the shared queue mode)
+    size_t local_backlog()
+    {
+        thread_pool_worker* self = local_worker();
+        return self != NULL ? self->m_deque.size() : 0;
+    }
+
+    schedule_mode mode() const
+    {
+        return m_data.m_mode;
+    }
+
+    // number of workers running now
+    int threads() const
+    {
+        return __atomic_load_n(&m_data.m_scaling.m_threads, __ATOMIC_RELAXED);
+    }
+
+    // snapshot of the elastic policy's counters
+    thread_pool_scaling scaling() const
+    {
+        const thread_pool_scaling& sc = m_data.m_scaling;
+        thread_pool_scaling result;
+        result.m_threads = __atomic_load_n(&sc.m_threads, __ATOMIC_RELAXED);
+        result.m_peak_threads = __atomic_load_n(&sc.m_peak_threads, __ATOMIC_RELAXED);
+        result.m_spawned = __atomic_load_n(&sc.m_spawned, __ATOMIC_RELAXED);
+        result.m_retired = __atomic_load_n(&sc.m_retired, __ATOMIC_RELAXED);
+        result.m_grow_by_depth = __atomic_load_n(&sc.m_grow_by_depth, __ATOMIC_RELAXED);
+        result.m_grow_by_wait = __atomic_load_n(&sc.m_grow_by_wait, __ATOMIC_RELAXED);
+        result.m_spawn_failed = __atomic_load_n(&sc.m_spawn_failed, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    // Adds up every worker's counters and histograms. Workers keep running,
+    // so the numbers are only consistent with each other approximately.
+    thread_pool_stats snapshot() const
+    {
+        thread_pool_stats result;
+        result.m_workers.resize(m_data.m_workers.size());
+        for (size_t i = 0; i < m_data.m_workers.size(); ++i)
+        {
+            thread_pool_worker* w = m_data.worker_at(i);
+            if (w == NULL)
+                continue;
+            result.m_workers[i].merge(w->m_stats);
+            result.m_total.merge(w->m_stats);
+        }
+        result.m_queue_depth = m_data.m_pool.size();
+        result.m_queue_hwm = stat_load(m_data.m_queue_hwm);
+        result.m_submitted = m_data.m_submitted.load();
+        result.m_rejected = m_data.m_rejected.load();
+        result.m_helped = m_data.m_helped.load();
+        return result;
+    }
+
+    pool_state state() const
+    {
+        return m_data.state();
     }
 
+    // Graceful stop. Tasks from other threads are rejected from now on
+    // (push() returns false) and pending timers are dropped. With
+    // drain_all the workers first run all queued tasks and whatever those
+    // push; when timeout_ms (< 0: no limit) expires they stop after their
+    // current task instead. Waits until all workers have exited and
+    // returns the tasks which did not run, the caller must run() or
+    // dispose() each of them (a disposed submit() task breaks its future,
+    // get() throws broken_promise). Only the first call (or notify())
+    // stops the pool, later ones return nothing.
+    std::vector<small_task> shutdown(drain_mode mode = drain_all, int timeout_ms = -1)
+    {
+        std::vector<small_task> rest;
+        if (!m_data.transition(pool_running, pool_closing))
+            return rest;
+        // pending timers are dropped, not returned
+        stop_timers();
+
+        // a push which got past the admission check is queued before we go on
+        while (__atomic_load_n(&m_data.m_pushers, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
+
+        if (mode == drain_all && threads() > 0)
+        {
+            int64_t deadline = timeout_ms < 0 ? -1 : stdx::monotonic_msec() + timeout_ms;
+            m_data.transition(pool_closing, pool_draining);
+            // every worker may have gone (cancel()) before the drain began,
+            // exited() only ends a drain it sees
+            if (__atomic_load_n(&m_data.m_live, __ATOMIC_SEQ_CST) == 0)
+                m_data.transition(pool_draining, pool_stopping);
+            // parked workers have to look again, the last one ends the drain
+            m_data.wakeup_all();
+
+            int st;
+            while ((st = __atomic_load_n(&m_data.m_state, __ATOMIC_SEQ_CST)) == pool_draining)
+            {
+                if (deadline < 0)
+                {
+                    stdx::futex_wait(&m_data.m_state, st);
+                    continue;
+                }
+                int64_t left = deadline - stdx::monotonic_msec();
+                if (left <= 0)
+                    break;
+                struct timespec ts = { left / 1000, (left % 1000) * 1000000L };
+                stdx::futex_wait(&m_data.m_state, st, &ts);
+            }
+        }
+        m_data.stop();
+
+        if (m_data.m_detached)
+        {
+            int live;
+            while ((live = __atomic_load_n(&m_data.m_live, __ATOMIC_SEQ_CST)) != 0)
+                stdx::futex_wait(&m_data.m_live, live);
+        }
+        else
+        {
+            join();
+        }
+
+        small_task task;
+        while (m_data.m_pool.pop(task))
+            rest.push_back(task);
+        for (size_t i = 0; i < m_data.m_workers.size(); ++i)
+        {
+            thread_pool_worker* w = m_data.worker_at(i);
+            while (w != NULL && w->m_deque.pop(task))
+                rest.push_back(task);
+        }
+        return rest;
+    }
+
+    // Stops the workers after their current task without waiting for them,
+    // queued tasks are dropped with the pool. Prefer shutdown().
     void notify()
     {
-        m_data.m_running = false;
-        m_data.m_cond.notify_all();
+        m_data.stop();
+        stop_timers();
     }
 
     void cancel()
     {
-        for (threadid_list::iterator it = m_tids.begin(); it != m_tids.end(); ++it)
         {
-            pthread_cancel(*it);
+            stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+            for (threadid_list::iterator it = m_data.m_tids.begin(); it != m_data.m_tids.end(); ++it)
+            {
+                pthread_cancel(*it);
+            }
         }
+        // parked workers only notice at pthread_testcancel() after waking
+        m_data.wakeup_all();
     }
 
+    // Retired elastic workers are gone from m_tids already, and after
+    // notify() or shutdown() no worker retires or gets spawned any more.
     void join()
     {
-        for (threadid_list::iterator it = m_tids.begin(); it != m_tids.end(); ++it)
+        threadid_list tids;
+        {
+            stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+            tids = m_data.m_tids;
+        }
+        for (threadid_list::iterator it = tids.begin(); it != tids.end(); ++it)
         {
             void* pvalue;
             pthread_join(*it, &pvalue);
         }
+
+        stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+        for (threadid_list::iterator it = tids.begin(); it != tids.end(); ++it)
+            m_data.m_tids.remove(*it);
     }
 
     void detach()
     {
-        for (threadid_list::iterator it = m_tids.begin(); it != m_tids.end(); ++it)
+        stdx::lock_guard<stdx::mutex> guard(m_data.m_threads_mutex);
+        m_data.m_detached = true;
+        for (threadid_list::iterator it = m_data.m_tids.begin(); it != m_data.m_tids.end(); ++it)
         {
             pthread_detach(*it);
         }
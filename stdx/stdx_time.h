@@ -4,6 +4,10 @@
 // C 89 header files
 #include <time.h>
 #include <assert.h>
+#include <stdint.h>
+
+// C++ 98 header files
+#include <string>
 
 namespace stdx {
 
@@ -14,6 +18,25 @@ millisleep(int ms)
     nanosleep(&ts, NULL);
 }
 
+// CLOCK_MONOTONIC in nanoseconds, for measuring intervals
+inline int64_t
+monotonic_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// CLOCK_MONOTONIC_COARSE in milliseconds (a few ms resolution, but no
+// more expensive than a memory read)
+inline int64_t
+monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 class timeinfo
 {
 private:
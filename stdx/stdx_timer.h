@@ -0,0 +1,575 @@
+#ifndef __STDX_TIMER_H
+#define __STDX_TIMER_H
+
+// Posix header files
+#include <pthread.h>
+
+// C 89 header files
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// C++ 98 header files
+#include <new>      // for placement new
+#include <vector>
+#include <stdexcept>
+
+// stdx header files
+#include "stdx/stdx_noncopyable.h"
+#include "stdx/stdx_mutex.h"
+#include "stdx/stdx_alloc.h"
+#include "stdx/stdx_futex.h"
+#include "stdx/stdx_time.h"
+#include "stdx/stdx_string.h"
+#include "stdx/stdx_small_task.h"  // for task_disposed()
+
+
+namespace stdx {
+
+//
+// The function of a timer, reference counted: the wheel holds one
+// reference while the timer is pending, every firing handed to a
+// dispatcher holds another one until it has run. A periodic timer is not
+// dispatched again while its previous firing has not finished. The
+// function of a one-shot timer which never runs (its firing refused or
+// disposed, or still pending when the wheel stops) goes to
+// task_disposed().
+//
+class timer_callback : private noncopyable
+{
+private:
+    int m_refs;
+    int m_busy;
+    bool m_once;
+
+protected:
+    explicit timer_callback(bool once) : m_refs(1), m_busy(0), m_once(once)
+    { }
+
+    virtual ~timer_callback() { }
+
+    virtual void destroy() = 0;
+
+public:
+    virtual void call() = 0;
+
+    virtual void dispose() = 0;
+
+    void add_ref()
+    {
+        __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+
+    void release()
+    {
+        if (__atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL) == 0)
+            destroy();
+    }
+
+    // claims the next firing, false while the last one is still running
+    bool try_fire()
+    {
+        return __atomic_exchange_n(&m_busy, 1, __ATOMIC_ACQUIRE) == 0;
+    }
+
+    void fired()
+    {
+        __atomic_store_n(&m_busy, 0, __ATOMIC_RELEASE);
+    }
+
+    // a firing, or the pending timer, goes away without running
+    void dropped()
+    {
+        if (m_once)
+            dispose();
+    }
+};
+
+template <typename F>
+class timer_callback_impl : public timer_callback
+{
+private:
+    F m_func;
+
+    timer_callback_impl(const F& f, bool once) : timer_callback(once), m_func(f)
+    { }
+
+protected:
+    void destroy()
+    {
+        this->~timer_callback_impl();
+        fixed_pool<sizeof(timer_callback_impl)>::deallocate(this);
+    }
+
+public:
+    static timer_callback_impl* create(const F& f, bool once)
+    {
+        return new(fixed_pool<sizeof(timer_callback_impl)>::allocate()) timer_callback_impl(f, once);
+    }
+
+    void call()
+    {
+        m_func();
+    }
+
+    void dispose()
+    {
+        task_disposed(m_func);
+    }
+};
+
+// One firing of a timer, small and trivially copyable so that it is
+// queued inline in a small_task.
+struct timer_fire
+{
+    timer_callback* m_callback;
+
+    explicit timer_fire(timer_callback* cb) : m_callback(cb)
+    { }
+
+    void operator()()
+    {
+        m_callback->call();
+        m_callback->fired();
+        m_callback->release();
+    }
+
+    // the dispatcher refused it
+    void drop()
+    {
+        m_callback->dropped();
+        m_callback->fired();
+        m_callback->release();
+    }
+};
+
+// A queued firing disposed instead of run (small_task::dispose() finds it
+// by ADL) gives its reference back like a refused one.
+inline void
+task_disposed(timer_fire& f)
+{
+    f.drop();
+}
+
+// Hands a firing to whoever runs it, returns false if it refused. The
+// default (NULL) runs it on the timer thread.
+typedef bool (*timer_dispatch)(void* ctx, const timer_fire& fire);
+
+// What schedule_*() return, to cancel the timer later. Invalid when the
+// timer was rejected.
+struct timer_id
+{
+    void* m_node;
+    unsigned m_gen;
+
+    timer_id() : m_node(NULL), m_gen(0)
+    { }
+
+    bool valid() const
+    {
+        return m_node != NULL;
+    }
+};
+
+//
+// Hierarchical timing wheel (Varghese & Lauck) with 1 ms ticks.
+//
+// Four levels of 256 slots cover 2^32 ms, longer delays are clamped.
+// A timer sits in the level where its distance to the wheel's time fits
+// and moves down a level whenever the level below wraps around, so add()
+// and cancel() are O(1) under one mutex. Nodes come from a free list and
+// are never freed while the wheel lives; a generation count tells a
+// stale timer_id from a reused node.
+//
+// One thread drives the wheel. It sleeps on a futex until the next busy
+// slot of the lowest level (or the next cascade), an earlier add() wakes
+// it up.
+//
+class timer_wheel : private noncopyable
+{
+private:
+    enum { level_bits = 8, slots = 1 << level_bits, levels = 4 };
+    enum { chunk_size = 256 };
+
+    struct node
+    {
+        node* m_next;
+        node** m_pprev;         // NULL when not in a slot
+        uint64_t m_expires;     // tick
+        uint64_t m_period;      // ticks, 0 for one-shot timers
+        timer_callback* m_callback;
+        unsigned m_gen;
+        unsigned m_slot;        // level * slots + index
+    };
+
+    mutex m_mutex;
+    node* m_slots[levels * slots];
+    uint64_t m_busy[slots / 64];    // non-empty slots of level 0
+    node* m_free;
+    std::vector<node*> m_chunks;
+    size_t m_pending;
+    uint64_t m_now;             // last tick processed
+    uint64_t m_wake_tick;       // when the thread plans to look again
+    int64_t m_base_ns;
+    timer_dispatch m_dispatch;
+    void* m_ctx;
+
+    int m_seq;                  // futex word, bumped to wake the thread
+    bool m_stop;
+    pthread_t m_tid;
+
+    uint64_t current_tick() const
+    {
+        return (stdx::monotonic_nsec() - m_base_ns) / 1000000;
+    }
+
+    node* alloc_node()
+    {
+        if (m_free == NULL)
+        {
+            node* chunk = new node[chunk_size];
+            m_chunks.push_back(chunk);
+            for (size_t i = 0; i < chunk_size; ++i)
+            {
+                chunk[i].m_gen = 0;
+                chunk[i].m_pprev = NULL;
+                chunk[i].m_next = m_free;
+                m_free = &chunk[i];
+            }
+        }
+        node* n = m_free;
+        m_free = n->m_next;
+        return n;
+    }
+
+    void free_node(node* n)
+    {
+        ++n->m_gen;
+        n->m_pprev = NULL;
+        n->m_next = m_free;
+        m_free = n;
+    }
+
+    void link(node* n)
+    {
+        uint64_t diff = n->m_expires - m_now;
+        unsigned slot;
+        if (diff < slots)
+        {
+            slot = n->m_expires & (slots - 1);
+            m_busy[slot / 64] |= 1ull << (slot % 64);
+        }
+        else
+        {
+            if (diff >= 1ull << (levels * level_bits))
+                n->m_expires = m_now + (1ull << (levels * level_bits)) - 1;
+            unsigned level = 1;
+            while (diff >= 1ull << ((level + 1) * level_bits) && level < levels - 1)
+                ++level;
+            slot = level * slots + ((n->m_expires >> (level * level_bits)) & (slots - 1));
+        }
+
+        n->m_slot = slot;
+        n->m_next = m_slots[slot];
+        if (n->m_next != NULL)
+            n->m_next->m_pprev = &n->m_next;
+        n->m_pprev = &m_slots[slot];
+        m_slots[slot] = n;
+    }
+
+    void unlink(node* n)
+    {
+        *n->m_pprev = n->m_next;
+        if (n->m_next != NULL)
+            n->m_next->m_pprev = n->m_pprev;
+        n->m_pprev = NULL;
+        if (n->m_slot < slots && m_slots[n->m_slot] == NULL)
+            m_busy[n->m_slot / 64] &= ~(1ull << (n->m_slot % 64));
+    }
+
+    // moves the timers of one upper slot down, returns the slot index
+    unsigned cascade(unsigned level)
+    {
+        unsigned index = (m_now >> (level * level_bits)) & (slots - 1);
+        node* n = m_slots[level * slots + index];
+        m_slots[level * slots + index] = NULL;
+        while (n != NULL)
+        {
+            node* next = n->m_next;
+            link(n);
+            n = next;
+        }
+        return index;
+    }
+
+    // advances m_now by one tick, collects the callbacks due
+    void tick(std::vector<timer_callback*>& due)
+    {
+        ++m_now;
+        unsigned index = m_now & (slots - 1);
+        for (unsigned level = 1; index == 0 && level < levels; ++level)
+            index = cascade(level);
+
+        index = m_now & (slots - 1);
+        node* n = m_slots[index];
+        m_slots[index] = NULL;
+        m_busy[index / 64] &= ~(1ull << (index % 64));
+        while (n != NULL)
+        {
+            node* next = n->m_next;
+            n->m_pprev = NULL;
+            if (n->m_callback->try_fire())
+            {
+                n->m_callback->add_ref();
+                due.push_back(n->m_callback);
+            }
+            if (n->m_period > 0)
+            {
+                n->m_expires += n->m_period;
+                if (n->m_expires <= m_now)
+                    n->m_expires = m_now + 1;
+                link(n);
+            }
+            else
+            {
+                n->m_callback->release();
+                free_node(n);
+                --m_pending;
+            }
+            n = next;
+        }
+    }
+
+    // the next tick worth waking up for, caller holds m_mutex
+    uint64_t next_tick() const
+    {
+        if (m_pending == 0)
+            return ~(uint64_t)0;
+        unsigned start = (m_now + 1) & (slots - 1);
+        if (start == 0)
+            return m_now + 1;
+        // busy level 0 slots up to the next wrap
+        for (unsigned w = start / 64; w < slots / 64; ++w)
+        {
+            uint64_t bits = m_busy[w];
+            if (w == start / 64)
+                bits &= ~0ull << (start % 64);
+            if (bits != 0)
+                return (m_now | (slots - 1)) - (slots - 1) + w * 64 + __builtin_ctzll(bits);
+        }
+        // nothing before the wrap, level 1 cascades then
+        return (m_now | (slots - 1)) + 1;
+    }
+
+    void run()
+    {
+        std::vector<timer_callback*> due;
+        m_mutex.lock();
+        while (!m_stop)
+        {
+            uint64_t now = current_tick();
+            // an empty wheel has no ticks to replay
+            if (m_pending == 0 && m_now < now)
+                m_now = now;
+            while (m_now < now)
+            {
+                tick(due);
+                if (!due.empty())
+                {
+                    m_mutex.unlock();
+                    dispatch(due);
+                    m_mutex.lock();
+                    if (m_stop)
+                        break;
+                }
+            }
+            if (m_stop)
+                break;
+
+            m_wake_tick = next_tick();
+            int seq = m_seq;
+            m_mutex.unlock();
+
+            if (m_wake_tick == ~(uint64_t)0)
+            {
+                stdx::futex_wait(&m_seq, seq);
+            }
+            else
+            {
+                int64_t wait_ns = (int64_t)m_wake_tick * 1000000 + m_base_ns - stdx::monotonic_nsec();
+                if (wait_ns > 0)
+                {
+                    struct timespec ts = { wait_ns / 1000000000, wait_ns % 1000000000 };
+                    stdx::futex_wait(&m_seq, seq, &ts);
+                }
+            }
+            m_mutex.lock();
+        }
+        m_mutex.unlock();
+    }
+
+    void dispatch(std::vector<timer_callback*>& due)
+    {
+        for (size_t i = 0; i < due.size(); ++i)
+        {
+            timer_fire fire(due[i]);
+            if (m_dispatch == NULL)
+                fire();
+            else if (!m_dispatch(m_ctx, fire))
+                fire.drop();
+        }
+        due.clear();
+    }
+
+    static void* routine(void* arg)
+    {
+        static_cast<timer_wheel*>(arg)->run();
+        return 0;
+    }
+
+    void wake_thread()
+    {
+        __atomic_add_fetch(&m_seq, 1, __ATOMIC_RELEASE);
+        stdx::futex_wake(&m_seq);
+    }
+
+    // Frees the pending timers of a stopped wheel. The functions of the
+    // one-shot ones go to task_disposed(), outside the mutex as they may
+    // come back to the wheel.
+    void drop_pending()
+    {
+        std::vector<timer_callback*> dropped;
+        {
+            lock_guard<mutex> guard(m_mutex);
+            for (size_t i = 0; i < levels * slots; ++i)
+            {
+                node* n = m_slots[i];
+                m_slots[i] = NULL;
+                while (n != NULL)
+                {
+                    node* next = n->m_next;
+                    dropped.push_back(n->m_callback);
+                    free_node(n);
+                    n = next;
+                }
+            }
+            for (size_t i = 0; i < slots / 64; ++i)
+                m_busy[i] = 0;
+            m_pending = 0;
+        }
+        for (size_t i = 0; i < dropped.size(); ++i)
+        {
+            dropped[i]->dropped();
+            dropped[i]->release();
+        }
+    }
+
+public:
+    explicit timer_wheel(timer_dispatch dispatch = NULL, void* ctx = NULL)
+        : m_free(NULL), m_pending(0), m_now(0), m_wake_tick(~(uint64_t)0),
+          m_base_ns(stdx::monotonic_nsec()), m_dispatch(dispatch), m_ctx(ctx),
+          m_seq(0), m_stop(false)
+    {
+        for (size_t i = 0; i < levels * slots; ++i)
+            m_slots[i] = NULL;
+        for (size_t i = 0; i < slots / 64; ++i)
+            m_busy[i] = 0;
+
+        if (pthread_create(&m_tid, NULL, &timer_wheel::routine, this) != 0)
+            throw std::runtime_error(stdx::stdx_strerror("stdx::timer_wheel::pthread_create: "));
+    }
+
+    ~timer_wheel()
+    {
+        stop();
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+            delete [] m_chunks[i];
+    }
+
+    // Stops the timer thread (after the firings it is dispatching), pending
+    // timers never fire and are freed. Safe to call more than once.
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(m_mutex);
+            if (m_stop)
+                return;
+            m_stop = true;
+        }
+        wake_thread();
+        pthread_join(m_tid, NULL);
+        drop_pending();
+    }
+
+    // Calls f after delay_ms, and then every period_ms if that is not 0.
+    // Once the wheel is stopped f is dropped and the id is invalid.
+    template <typename F>
+    timer_id add(int64_t delay_ms, int64_t period_ms, F f)
+    {
+        timer_callback* cb = timer_callback_impl<F>::create(f, period_ms <= 0);
+
+        lock_guard<mutex> guard(m_mutex);
+        if (m_stop)
+        {
+            cb->release();
+            return timer_id();
+        }
+        uint64_t now = current_tick();
+        // the wheel may have slept for long while empty, catch up first so
+        // the timer is linked relative to the current tick
+        if (m_pending == 0 && m_now < now)
+            m_now = now;
+        node* n = alloc_node();
+        // the next full tick after the delay, never in the wheel's past
+        n->m_expires = now + (delay_ms > 0 ? delay_ms : 0) + 1;
+        if (n->m_expires <= m_now)
+            n->m_expires = m_now + 1;
+        n->m_period = period_ms > 0 ? period_ms : 0;
+        n->m_callback = cb;
+        link(n);
+        ++m_pending;
+
+        timer_id id;
+        id.m_node = n;
+        id.m_gen = n->m_gen;
+
+        if (n->m_expires < m_wake_tick)
+        {
+            m_wake_tick = n->m_expires;
+            wake_thread();
+        }
+        return id;
+    }
+
+    // Returns true if the timer was pending and will not fire any more; a
+    // firing already dispatched still runs.
+    bool cancel(const timer_id& id)
+    {
+        node* n = static_cast<node*>(id.m_node);
+        if (n == NULL)
+            return false;
+
+        lock_guard<mutex> guard(m_mutex);
+        if (n->m_gen != id.m_gen || n->m_pprev == NULL)
+            return false;
+        unlink(n);
+        n->m_callback->release();
+        free_node(n);
+        --m_pending;
+        return true;
+    }
+
+    // number of pending timers
+    size_t size()
+    {
+        lock_guard<mutex> guard(m_mutex);
+        return m_pending;
+    }
+};
+
+} // namespace stdx
+
+
+#endif // __STDX_TIMER_H
+
+// vim:set tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,115 @@
+/***************************************************
+ * test case for coroutines on stdx::thread_pool
+ * around shutdown(drain_none): a coroutine parked in
+ * pool_yield comes back from shutdown(), disposing it
+ * must destroy its frame and break its future, and so
+ * must a coroutine sleeping in sleep_for. an exception
+ * thrown by a coroutine reaches future::get().
+ * a local counts the live frames, so a leaked frame
+ * shows up as a count left over.
+ * needs C++20 (g++ -std=c++20).
+ * *************************************************/
+#include <stdio.h>
+#include <stdexcept>
+#include "stdx/stdx_coroutine.h"
+
+static int g_live = 0;
+
+struct frame_count
+{
+	frame_count()
+	{
+		__atomic_add_fetch(&g_live, 1, __ATOMIC_RELAXED);
+	}
+	~frame_count()
+	{
+		__atomic_sub_fetch(&g_live, 1, __ATOMIC_RELAXED);
+	}
+};
+
+struct busy
+{
+	void operator()() const
+	{
+		stdx::millisleep(100);
+	}
+};
+
+//queues a busy task, then waits behind it
+static stdx::co_task<int> yielder(stdx::thread_pool& pool)
+{
+	frame_count count;
+	pool.push(busy());
+	co_await stdx::pool_yield(pool);
+	co_return 1;
+}
+
+static stdx::co_task<int> sleeper(stdx::thread_pool& pool)
+{
+	frame_count count;
+	co_await stdx::sleep_for(pool, 900);
+	co_return 2;
+}
+
+static stdx::co_task<int> thrower(stdx::thread_pool& pool)
+{
+	co_await stdx::resume_on(pool);
+	throw std::runtime_error("thrower");
+	co_return 3;
+}
+
+static int check(const char* name, bool ok)
+{
+	printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+template <typename T>
+static bool broken(stdx::future<T>& f)
+{
+	try
+	{
+		f.get();
+	}
+	catch(stdx::broken_promise&)
+	{
+		return true;
+	}
+	return false;
+}
+
+int main()
+{
+	int failed = 0;
+	{
+		stdx::thread_pool pool(1);
+
+		stdx::future<int> thrown = stdx::co_spawn(pool, thrower(pool));
+		bool caught = false;
+		try
+		{
+			thrown.get();
+		}
+		catch(std::runtime_error&)
+		{
+			caught = true;
+		}
+		failed += check("exception reaches future::get()", caught);
+
+		stdx::future<int> asleep = stdx::co_spawn(pool, sleeper(pool));
+		stdx::future<int> parked = stdx::co_spawn(pool, yielder(pool));
+		stdx::millisleep(20);
+
+		std::vector<stdx::small_task> rest = pool.shutdown(stdx::drain_none);
+		failed += check("parked coroutine returned by shutdown()", rest.size() == 1);
+		for(size_t i = 0; i < rest.size(); ++i)
+		{
+			rest[i].dispose();
+		}
+		failed += check("disposed coroutine breaks its future", parked.ready() && broken(parked));
+		failed += check("sleeping coroutine breaks its future", asleep.ready() && broken(asleep));
+		failed += check("co_spawn() after shutdown()", !stdx::co_spawn(pool, sleeper(pool)).valid());
+	}
+	failed += check("no coroutine frame left", g_live == 0);
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+/***************************************************
+ * test case for stdx::thread_pool::shutdown() after
+ * cancel(): the cancelled workers must leave the pool
+ * and the drain must end when no worker is left,
+ * instead of waiting for idle workers forever.
+ * an alarm() kills the test if shutdown() hangs.
+ * *************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include "stdx/stdx_thread.h"
+
+struct nap
+{
+	void operator()() const
+	{
+		//nanosleep is a cancellation point, so cancel() hits workers here
+		stdx::millisleep(2);
+	}
+};
+
+static int check(const char* name, bool ok)
+{
+	printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+//cancel() while the workers run tasks, then the default shutdown()
+static int cancel_then_drain(stdx::schedule_mode mode, bool busy)
+{
+	stdx::thread_pool_attr attr;
+	attr.m_mode = mode;
+	stdx::thread_pool pool(4, attr);
+	for(int i = 0; busy && i < 200; ++i)
+	{
+		pool.push(nap());
+	}
+	stdx::millisleep(10);
+	pool.cancel();
+
+	alarm(10);
+	std::vector<stdx::small_task> rest = pool.shutdown();
+	alarm(0);
+	for(size_t i = 0; i < rest.size(); ++i)
+	{
+		rest[i].dispose();
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s, %s: threads() after shutdown",
+			mode == stdx::schedule_work_stealing ? "stealing" : "shared",
+			busy ? "busy" : "idle");
+	return check(name, pool.threads() == 0 && pool.state() == stdx::pool_stopping);
+}
+
+int main()
+{
+	int failed = 0;
+	failed += cancel_then_drain(stdx::schedule_shared_queue, false);
+	failed += cancel_then_drain(stdx::schedule_shared_queue, true);
+	failed += cancel_then_drain(stdx::schedule_work_stealing, false);
+	failed += cancel_then_drain(stdx::schedule_work_stealing, true);
+	return failed == 0 ? 0 : 1;
+}
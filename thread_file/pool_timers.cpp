@@ -0,0 +1,80 @@
+/***************************************************
+ * test case for stdx::thread_pool timers around
+ * shutdown(drain_none): firings queued behind a busy
+ * worker come back from shutdown(), disposing them
+ * must release their timer, and scheduling after
+ * shutdown() is rejected like push().
+ * a closure counts its live copies, so a leaked
+ * timer shows up as a copy left over.
+ * *************************************************/
+#include <stdio.h>
+#include "stdx/stdx_thread.h"
+
+static int g_live = 0;
+static int g_runs = 0;
+
+struct counted
+{
+	counted()
+	{
+		__atomic_add_fetch(&g_live, 1, __ATOMIC_RELAXED);
+	}
+	counted(const counted&)
+	{
+		__atomic_add_fetch(&g_live, 1, __ATOMIC_RELAXED);
+	}
+	~counted()
+	{
+		__atomic_sub_fetch(&g_live, 1, __ATOMIC_RELAXED);
+	}
+	void operator()() const
+	{
+		__atomic_add_fetch(&g_runs, 1, __ATOMIC_RELAXED);
+	}
+};
+
+struct busy
+{
+	void operator()() const
+	{
+		stdx::millisleep(100);
+	}
+};
+
+static int check(const char* name, bool ok)
+{
+	printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	int failed = 0;
+	{
+		stdx::thread_pool pool(1);
+		pool.push(busy());
+		stdx::millisleep(10);
+		//due while the only worker is busy, so they queue up
+		for(int i = 0; i < 10; ++i)
+		{
+			pool.schedule_after(1, counted());
+		}
+		pool.schedule_every(1, counted());
+		stdx::millisleep(50);
+
+		std::vector<stdx::small_task> rest = pool.shutdown(stdx::drain_none);
+		failed += check("queued firings returned by shutdown()", rest.size() == 11);
+		for(size_t i = 0; i < rest.size(); ++i)
+		{
+			rest[i].dispose();
+		}
+		failed += check("disposed firings did not run", g_runs == 0);
+
+		stdx::timer_id id = pool.schedule_after(1, counted());
+		failed += check("schedule_after() after shutdown()", !id.valid());
+		id = pool.schedule_every(1, counted());
+		failed += check("schedule_every() after shutdown()", !id.valid());
+	}
+	failed += check("no timer closure left", g_live == 0);
+	return failed == 0 ? 0 : 1;
+}
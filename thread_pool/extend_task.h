@@ -10,6 +10,7 @@
 #include <boost/thread.hpp>
 #include <queue>
 #include <boost/shared_ptr.hpp>
+#include "stdx/stdx_small_task.h"
 
 namespace extend
 {
@@ -43,35 +44,76 @@ namespace extend
 	class task_pool
 	{
 		public:
+			~task_pool()
+			{
+				while(!m_task.empty())
+				{
+					m_task.front().dispose();
+					m_task.pop();
+				}
+			}
+
 			template < typename F >
 			void push(F f)
 			{
-				boost::shared_ptr<task_base> ptr(new(std::nothrow) task<F>(f)); 
-				//task<F>* t = new (std::nothrow) task<F>(f);
+				//small closures are stored inline, no allocation
+				stdx::small_task t(f);
 				boost::recursive_mutex::scoped_lock lk(m_mtx);
-				m_task.push(ptr);
+				m_task.push(t);
 			}
 
-			boost::shared_ptr<task_base> pop()
+			//enqueue the whole range under one lock, return the count
+			template < typename InputIterator >
+			std::size_t push_bulk(InputIterator first, InputIterator last)
 			{
+				std::size_t n = 0;
 				boost::recursive_mutex::scoped_lock lk(m_mtx);
-				boost::shared_ptr<task_base> task;
-				while(!m_task.empty())
+				for(; first != last; ++first, ++n)
+				{
+					m_task.push(stdx::small_task(*first));
+				}
+				return n;
+			}
+
+			bool pop(stdx::small_task& task)
+			{
+				boost::recursive_mutex::scoped_lock lk(m_mtx);
+				if(m_task.empty())
+				{
+					return false;
+				}
+				task = m_task.front();
+				m_task.pop();
+				return true;
+			}
+
+			//dequeue up to max tasks under one lock, return the count
+			std::size_t pop_bulk(stdx::small_task* out, std::size_t max)
+			{
+				boost::recursive_mutex::scoped_lock lk(m_mtx);
+				std::size_t n = 0;
+				for(; n < max && !m_task.empty(); ++n)
 				{
-					task = m_task.front();
+					out[n] = m_task.front();
 					m_task.pop();
 				}
-				return task;
+				return n;
+			}
+
+			std::size_t size()
+			{
+				boost::recursive_mutex::scoped_lock  lk(m_mtx);
+				return m_task.size();
 			}
 
 			bool empty()
 			{
 				boost::recursive_mutex::scoped_lock  lk(m_mtx);
-				m_task.empty();
+				return m_task.empty();
 			}
 		private:
 			boost::recursive_mutex m_mtx;
-			std::queue<boost::shared_ptr<task_base> > m_task;
+			std::queue<stdx::small_task> m_task;
 	};
 }
 
@@ -9,22 +9,121 @@
 #include "extend_task.h"
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <iterator>
 #include <vector>
 //#include <thread>
 #include <boost/shared_ptr.hpp>
+#include "stdx/stdx_future.h"
+#include "stdx/stdx_thread.h"	//for stdx::pool_state and stdx::drain_mode
 
 namespace extend
 {
+	typedef  boost::shared_ptr<boost::thread>    thread_ptr;
+
+	//one thread's statistics, only that thread writes them (stdx::stat_add),
+	//on a cache line of their own
+	struct thread_counters : public stdx::cacheline_allocated
+	{
+		stdx::thread_pool_counters m_stats STDX_CACHELINE_ALIGNED;
+	};
+
+	//the counters of the pool thread running on the calling thread
+	inline thread_counters*& current_counters()
+	{
+		static __thread thread_counters* s_counters = NULL;
+		return s_counters;
+	}
+
 	struct thread_pool_data
 	{
-		thread_pool_data(): m_run(true)
+		thread_pool_data(std::size_t batch = 1)
+			: m_state(stdx::pool_running), m_batch(batch > 0 ? batch : 1),
+			  m_live(0), m_idle(0), m_time_tasks(false),
+			  m_queue_hwm(0), m_submitted(0), m_rejected(0),
+			  m_min_threads(1), m_max_threads(0), m_grow_depth(16),
+			  m_grow_wait_ms(5), m_keep_alive_ms(60000),
+			  m_last_drained_ms(0), m_last_grow_ms(0)
 		{
 		}
-		volatile bool m_run;
+		~thread_pool_data()
+		{
+			for(std::size_t i = 0; i < m_counters.size(); ++i)
+			{
+				delete m_counters[i];
+			}
+		}
+		//elastic mode is on when m_max_threads > 0, see stdx::thread_pool_attr
+		bool elastic() const
+		{
+			return m_max_threads > 0;
+		}
+		//stdx::pool_state, changed under m_mxt, read without it too
+		int state()
+		{
+			return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE);
+		}
+		void set_state(int state)
+		{
+			__atomic_store_n(&m_state, state, __ATOMIC_RELEASE);
+		}
+
+		int m_state;
+		std::size_t m_batch;	//tasks taken per dequeue
+		std::size_t m_live;		//threads not yet returned, guarded by m_mxt
+		std::size_t m_idle;		//waiting threads, guarded by m_mxt
+		//statistics, see thread_pool::snapshot(); m_counters holds one
+		//entry per thread ever started (retired ones too), all guarded by m_mxt
+		bool m_time_tasks;
+		std::vector<thread_counters*> m_counters;
+		uint64_t m_queue_hwm;
+		uint64_t m_submitted;
+		uint64_t m_rejected;
 		extend::task_pool m_task;
 		boost::recursive_mutex m_mxt;
 		boost::condition_variable_any m_cond;
+		//the threads not retired, guarded by m_mxt
+		std::vector<thread_ptr> m_threads;
+
+		//elastic policy and its counters, guarded by m_mxt
+		int m_min_threads;
+		int m_max_threads;
+		std::size_t m_grow_depth;
+		int m_grow_wait_ms;
+		int m_keep_alive_ms;
+		int64_t m_last_drained_ms;
+		int64_t m_last_grow_ms;
+		stdx::thread_pool_scaling m_scaling;
+
+		//An elastic thread which waited m_keep_alive_ms for work leaves,
+		//unless the pool would go below m_min_threads. Nobody joins it,
+		//so it detaches. Caller holds m_mxt.
+		bool retire()
+		{
+			if(m_state != stdx::pool_running || (int)m_live <= m_min_threads || !m_task.empty())
+			{
+				return false;
+			}
+			boost::thread::id self = boost::this_thread::get_id();
+			for(std::size_t i = 0; i < m_threads.size(); ++i)
+			{
+				if(m_threads[i]->get_id() == self)
+				{
+					m_threads[i]->detach();
+					m_threads.erase(m_threads.begin() + i);
+					break;
+				}
+			}
+			++m_scaling.m_retired;
+			return true;
+		}
 	};
+
+	//the pool the calling thread works for, NULL for other threads
+	inline thread_pool_data*& current_pool()
+	{
+		static __thread thread_pool_data* s_pool = NULL;
+		return s_pool;
+	}
 }
 
 namespace extend
@@ -38,25 +137,83 @@ namespace extend
 			pdata->m_cond.notify_all();
 		}
 
-		inline void* thread_pool_routine(void* arg)
+		inline void* extend_pool_routine(void* arg)
 		{
-			pthread_cleanup_push(clean_up_routine, arg);
 			extend::thread_pool_data* pdata = static_cast<extend::thread_pool_data*>(arg);
-			while(pdata->m_run)
+			bool retired = false;
+			extend::thread_counters* counters = new extend::thread_counters;
+			stdx::thread_pool_counters& stats = counters->m_stats;
 			{
-				boost::shared_ptr<task_base> ptr = pdata->m_task.pop();
-				if(NULL != ptr.get())
+				boost::recursive_mutex::scoped_lock lk(pdata->m_mxt);
+				pdata->m_counters.push_back(counters);
+			}
+			pthread_cleanup_push(clean_up_routine, arg);
+			extend::current_pool() = pdata;
+			extend::current_counters() = counters;
+			std::vector<stdx::small_task> batch(pdata->m_batch);
+			while(pdata->state() < stdx::pool_stopping)
+			{
+				std::size_t n = pdata->m_task.pop_bulk(&batch[0], batch.size());
+				if(n > 0)
 				{
-					ptr->run();
+					for(std::size_t i = 0; i < n; ++i)
+					{
+						batch[i].run();
+					}
+					stdx::stat_add(stats.m_executed, n);
+					continue;
 				}
-				else
+
+				//look at the queue again under m_mxt: push() notifies under it,
+				//so a task queued after pop_bulk() cannot be missed
+				pdata->m_mxt.lock();
+				while(pdata->m_state < stdx::pool_stopping && pdata->m_task.empty())
+				{
+					if(pdata->m_state == stdx::pool_draining && pdata->m_idle + 1 >= pdata->m_live)
+					{
+						//everybody else waits and nothing is queued: drained
+						pdata->set_state(stdx::pool_stopping);
+						pdata->m_cond.notify_all();
+						break;
+					}
+					pdata->m_last_drained_ms = stdx::monotonic_msec();
+					bool timed_out = false;
+					int64_t park = stdx::monotonic_nsec();
+					++pdata->m_idle;
+					if(pdata->elastic())
+					{
+						//relative, so boost waits on its monotonic clock and a
+						//clock step does not retire anybody early (or never)
+						timed_out = !pdata->m_cond.timed_wait(pdata->m_mxt,
+							boost::posix_time::milliseconds(pdata->m_keep_alive_ms));
+					}
+					else
+					{
+						pdata->m_cond.wait(pdata->m_mxt);
+					}
+					--pdata->m_idle;
+					stdx::stat_add(stats.m_parks);
+					stdx::stat_add(stats.m_park_ns, stdx::monotonic_nsec() - park);
+					if(timed_out && pdata->retire())
+					{
+						retired = true;
+						break;
+					}
+				}
+				bool stop = pdata->m_state >= stdx::pool_stopping || retired;
+				pdata->m_mxt.unlock();
+				if(stop)
 				{
-					pdata->m_mxt.lock();
-					pdata->m_cond.wait(pdata->m_mxt);
-					pdata->m_mxt.unlock();
+					break;
 				}
 			}
 			pthread_cleanup_pop(0);
+
+			extend::current_pool() = NULL;
+			extend::current_counters() = NULL;
+			boost::recursive_mutex::scoped_lock lk(pdata->m_mxt);
+			--pdata->m_live;
+			pdata->m_cond.notify_all();
 			return NULL;
 		}
 	}
@@ -64,38 +221,285 @@ namespace extend
 
 namespace extend
 {
-	typedef  boost::shared_ptr<boost::thread>    thread_ptr;
+	//a task pushed while the pool times its tasks, records queue wait and
+	//run time in the histograms of the thread running it
+	template<typename F>
+	struct timed_task
+	{
+		F m_func;
+		int64_t m_enqueued;
+
+		timed_task(const F& f, int64_t now) : m_func(f), m_enqueued(now)
+		{
+		}
+
+		void operator()()
+		{
+			int64_t start = stdx::monotonic_nsec();
+			m_func();
+			thread_counters* counters = current_counters();
+			if(counters != NULL)
+			{
+				counters->m_stats.m_wait.record(start - m_enqueued);
+				counters->m_stats.m_run.record(stdx::monotonic_nsec() - start);
+			}
+		}
+	};
+
+	template<typename F>
+	inline void task_disposed(timed_task<F>& task)
+	{
+		using stdx::task_disposed;
+		task_disposed(task.m_func);
+	}
+
+	//Boost based pool with the submission API of stdx::thread_pool:
+	//push()/try_push()/submit()/push_bulk() return false, an invalid
+	//future or 0 once shutdown() has started, unless called from one of
+	//the pool's own threads. One mutex protected queue, no priorities.
 	class thread_pool
 	{
 		public:
-			thread_pool(std::size_t size)
+			thread_pool(std::size_t size, std::size_t batch = 1): m_data(batch)
+			{
+				start(size);
+			}
+
+			//Takes m_batch_size, m_time_tasks and the elastic policy
+			//(m_min_threads, m_max_threads, m_grow_depth, m_grow_wait_ms,
+			//m_keep_alive_ms) from attr, the rest of it is for
+			//stdx::thread_pool only.
+			thread_pool(std::size_t size, const stdx::thread_pool_attr& attr): m_data(attr.m_batch_size)
 			{
-				while(size > 0)
+				m_data.m_time_tasks = attr.m_time_tasks;
+				m_data.m_min_threads = attr.m_min_threads;
+				m_data.m_max_threads = attr.m_max_threads;
+				m_data.m_grow_depth = attr.m_grow_depth;
+				m_data.m_grow_wait_ms = attr.m_grow_wait_ms;
+				m_data.m_keep_alive_ms = attr.m_keep_alive_ms;
+				if(m_data.elastic())
 				{
-					thread_ptr  thr(new(std::nothrow) boost::thread(boost::bind(thread_pool_routine, (void*)(&m_data))));  
-					m_vec.push_back(thr);
+					if((int)size < m_data.m_min_threads)
+					{
+						size = m_data.m_min_threads;
+					}
+					if((int)size > m_data.m_max_threads)
+					{
+						size = m_data.m_max_threads;
+					}
 				}
+				start(size);
 			}
 
 			~thread_pool()
 			{
-				this->join();
+				this->shutdown(stdx::drain_all);
+				//detached threads still have to leave m_data
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				while(m_data.m_live > 0)
+				{
+					m_data.m_cond.wait(m_data.m_mxt);
+				}
+			}
+
+			template<typename F>
+			bool push(F f)
+			{
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				if(!accepting())
+				{
+					++m_data.m_rejected;
+					return false;
+				}
+				if(m_data.m_time_tasks)
+				{
+					m_data.m_task.push(timed_task<F>(f, stdx::monotonic_nsec()));
+				}
+				else
+				{
+					m_data.m_task.push(f);
+				}
+				pushed(1);
+				if(m_data.m_idle > 0)
+				{
+					m_data.m_cond.notify_one();
+				}
+				else
+				{
+					grow();
+				}
+				return true;
+			}
+
+			//the queue is unbounded, so this is push()
+			template<typename F>
+			bool try_push(F f)
+			{
+				return push(f);
 			}
 
+			//like push(), but hands back a future for f's result
 			template<typename F>
-			void push(F f)
+			stdx::future<typename stdx::task_result<F>::type> submit(F f)
 			{
-				m_data.m_run = false;
-				m_data.m_task.push(f);
-				m_data.m_cond.notify_one();
+				typedef typename stdx::task_result<F>::type R;
+				stdx::future<R> result;
+				if(!push(stdx::make_future_task(f, result)))
+				{
+					result.state()->release();
+					return stdx::future<R>();
+				}
+				return result;
+			}
+
+			//enqueue [first, last) at once, then wake min(n, idle) threads
+			template<typename InputIterator>
+			std::size_t push_bulk(InputIterator first, InputIterator last)
+			{
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				if(!accepting())
+				{
+					m_data.m_rejected += std::distance(first, last);
+					return 0;
+				}
+				std::size_t n = 0;
+				if(m_data.m_time_tasks)
+				{
+					int64_t now = stdx::monotonic_nsec();
+					std::vector<stdx::small_task> tasks;
+					for(; first != last; ++first)
+					{
+						typedef typename std::iterator_traits<InputIterator>::value_type F;
+						tasks.push_back(stdx::small_task(timed_task<F>(*first, now)));
+					}
+					n = m_data.m_task.push_bulk(tasks.begin(), tasks.end());
+				}
+				else
+				{
+					n = m_data.m_task.push_bulk(first, last);
+				}
+				pushed(n);
+				if(m_data.m_idle == 0)
+				{
+					grow();
+				}
+				if(n >= m_data.m_idle)
+				{
+					m_data.m_cond.notify_all();
+				}
+				else
+				{
+					for(std::size_t i = 0; i < n; ++i)
+					{
+						m_data.m_cond.notify_one();
+					}
+				}
+				return n;
+			}
+
+			//Stops taking tasks from outside and waits for the threads.
+			//drain_all runs everything queued (and what those tasks push)
+			//first, for at most timeout_ms when that is not negative;
+			//drain_none lets only the running tasks finish. Returns the
+			//tasks left in the queue, the caller runs or disposes them.
+			std::vector<stdx::small_task> shutdown(stdx::drain_mode mode = stdx::drain_all, int timeout_ms = -1)
+			{
+				{
+					boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+					if(m_data.m_state == stdx::pool_running)
+					{
+						m_data.set_state(stdx::pool_draining);
+						if(mode == stdx::drain_none || m_data.m_live == 0
+							|| (m_data.m_idle >= m_data.m_live && m_data.m_task.empty()))
+						{
+							m_data.set_state(stdx::pool_stopping);
+						}
+						m_data.m_cond.notify_all();
+					}
+
+					//monotonic deadline, each wait is relative to it
+					int64_t deadline = stdx::monotonic_msec() + timeout_ms;
+					while(m_data.m_state == stdx::pool_draining)
+					{
+						if(timeout_ms < 0)
+						{
+							m_data.m_cond.wait(m_data.m_mxt);
+							continue;
+						}
+						int64_t left = deadline - stdx::monotonic_msec();
+						if(left <= 0 || !m_data.m_cond.timed_wait(m_data.m_mxt, boost::posix_time::milliseconds(left)))
+						{
+							m_data.set_state(stdx::pool_stopping);
+							m_data.m_cond.notify_all();
+						}
+					}
+				}
+				this->join();
+
+				std::vector<stdx::small_task> left;
+				stdx::small_task task;
+				while(m_data.m_task.pop(task))
+				{
+					left.push_back(task);
+				}
+				return left;
 			}
-			
+
+			//stop the threads after their current tasks, the queue is kept
 			void notify()
 			{
-				m_data.m_run = false;
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				m_data.set_state(stdx::pool_stopping);
 				m_data.m_cond.notify_all();
 			}
 
+			stdx::pool_state state()
+			{
+				return static_cast<stdx::pool_state>(m_data.state());
+			}
+
+			std::size_t threads()
+			{
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				return m_data.m_live;
+			}
+
+			//counters of the elastic policy, m_threads is threads()
+			stdx::thread_pool_scaling scaling()
+			{
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				stdx::thread_pool_scaling result = m_data.m_scaling;
+				result.m_threads = m_data.m_live;
+				return result;
+			}
+
+			//tasks finished so far, counted after every batch
+			std::size_t executed()
+			{
+				return snapshot().m_total.m_executed;
+			}
+
+			//Adds up every thread's counters (and histograms, with
+			//m_time_tasks), like stdx::thread_pool::snapshot(). One entry
+			//in m_workers per thread started, retired ones included; there
+			//is no stealing, so those counters stay 0.
+			stdx::thread_pool_stats snapshot()
+			{
+				stdx::thread_pool_stats result;
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				result.m_workers.resize(m_data.m_counters.size());
+				for(std::size_t i = 0; i < m_data.m_counters.size(); ++i)
+				{
+					result.m_workers[i].merge(m_data.m_counters[i]->m_stats);
+					result.m_total.merge(m_data.m_counters[i]->m_stats);
+				}
+				result.m_queue_depth = m_data.m_task.size();
+				result.m_queue_hwm = m_data.m_queue_hwm;
+				result.m_submitted = m_data.m_submitted;
+				result.m_rejected = m_data.m_rejected;
+				return result;
+			}
+
 			//void  cancel()
 			//{
 			//	for(std::size_t i = 0; i < m_vec.size(); ++i)
@@ -104,26 +508,118 @@ namespace extend
 			//	}
 			//}
 
+			//retired threads are gone from the list already
 			void join()
 			{
-				for(std::size_t i = 0; i < m_vec.size(); ++i)
+				std::vector<thread_ptr> threads;
 				{
-					m_vec.at(i)->join();
+					boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+					threads = m_data.m_threads;
+				}
+				for(std::size_t i = 0; i < threads.size(); ++i)
+				{
+					if(threads.at(i)->joinable())
+					{
+						threads.at(i)->join();
+					}
 				}
 			}
 
 			void detach()
 			{
-				for(std::size_t i = 0; i < m_vec.size(); ++i)
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				for(std::size_t i = 0; i < m_data.m_threads.size(); ++i)
 				{
-					m_vec.at(i)->detach();
+					m_data.m_threads.at(i)->detach();
 				}
 			}
 
 		private:
+			//n tasks were queued, caller holds m_mxt
+			void pushed(std::size_t n)
+			{
+				m_data.m_submitted += n;
+				if(m_data.m_task.size() > m_data.m_queue_hwm)
+				{
+					m_data.m_queue_hwm = m_data.m_task.size();
+				}
+			}
+
+			void start(std::size_t size)
+			{
+				boost::recursive_mutex::scoped_lock lk(m_data.m_mxt);
+				m_data.m_last_drained_ms = stdx::monotonic_msec();
+				for(std::size_t i = 0; i < size; ++i)
+				{
+					if(!spawn())
+					{
+						break;
+					}
+				}
+			}
+
+			//caller holds m_mxt
+			bool spawn()
+			{
+				++m_data.m_live;
+				try
+				{
+					thread_ptr thr(new boost::thread(boost::bind(extend_pool_routine, (void*)(&m_data))));
+					m_data.m_threads.push_back(thr);
+				}
+				catch(...)
+				{
+					--m_data.m_live;
+					return false;
+				}
+				if((int)m_data.m_live > m_data.m_scaling.m_peak_threads)
+				{
+					m_data.m_scaling.m_peak_threads = m_data.m_live;
+				}
+				return true;
+			}
+
+			//An elastic pool adds a thread when nobody was idle to take a
+			//push and m_grow_depth tasks are queued, or the queue has not
+			//been drained for m_grow_wait_ms; at most one per m_grow_wait_ms.
+			//Caller holds m_mxt.
+			void grow()
+			{
+				if(!m_data.elastic() || m_data.m_state != stdx::pool_running
+					|| (int)m_data.m_live >= m_data.m_max_threads)
+				{
+					return;
+				}
+				std::size_t depth = m_data.m_task.size();
+				int64_t now = stdx::monotonic_msec();
+				bool by_depth = depth >= m_data.m_grow_depth;
+				bool by_wait = depth > 0 && now - m_data.m_last_drained_ms >= m_data.m_grow_wait_ms;
+				if(m_data.m_live > 0)
+				{
+					if((!by_depth && !by_wait) || now - m_data.m_last_grow_ms < m_data.m_grow_wait_ms)
+					{
+						return;
+					}
+				}
+				if(spawn())
+				{
+					++(by_depth ? m_data.m_scaling.m_grow_by_depth : m_data.m_scaling.m_grow_by_wait);
+					++m_data.m_scaling.m_spawned;
+					m_data.m_last_grow_ms = now;
+				}
+				else
+				{
+					++m_data.m_scaling.m_spawn_failed;
+				}
+			}
+
+			//caller holds m_mxt
+			bool accepting()
+			{
+				return m_data.m_state == stdx::pool_running || current_pool() == &m_data;
+			}
+
 			extend::thread_pool_data m_data;
-			std::size_t m_size;
-			std::vector<thread_ptr>  m_vec;
 	};
 }
 
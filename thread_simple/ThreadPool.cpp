@@ -3,9 +3,13 @@
 #include <assert.h>
 #include <stdlib.h>
 #include "ThreadPool.h"
+#include "stdx/stdx_time.h"
 
 using namespace std;
 
+//节点池每次分配的节点数
+static const int WORKER_CHUNK_SIZE = 256;
+
 ThreadPool::ThreadPool(int max_thread_num):max_thread_num(max_thread_num){}
 
 void ThreadPool::pool_init()
@@ -14,9 +18,14 @@ void ThreadPool::pool_init()
 	pthread_cond_init(&queue_ready, NULL);
 	shutdown = false;
 	queue_head = NULL;
-	threadid = (pthread_t*)malloc(max_thread_num * sizeof(pthread_t*));
+	queue_tail = NULL;
+	free_workers = NULL;
+	threadid = (pthread_t*)malloc(max_thread_num * sizeof(pthread_t));
 	cur_queue_size = 0;
-	printf("==========================  max_thread_num = %d\n", max_thread_num);
+	queue_hwm = 0;
+	thread_stats = new Thread_stats[max_thread_num]();
+	next_index = 0;
+	fprintf(stderr, "==========================  max_thread_num = %d\n", max_thread_num);
 	for(int i = 0; i < max_thread_num; i++)
 	{
 		pthread_create(&threadid[i],NULL,thread_routine,this);
@@ -27,79 +36,104 @@ void ThreadPool::pool_init()
 void* ThreadPool::thread_routine(void* arg)
 {
 	ThreadPool *pthis = (ThreadPool *)arg;
-	printf("Starting thread 0x%x\n", pthread_self());
+
+	pthread_mutex_lock(&(pthis->queue_lock));
+	Thread_stats& stats = pthis->thread_stats[pthis->next_index++];
+	pthread_mutex_unlock(&(pthis->queue_lock));
+
 	while(1)
 	{
 		pthread_mutex_lock(&(pthis->queue_lock));
 		while(pthis->cur_queue_size == 0 && pthis->shutdown == false)
 		{
-//			cout<<"thread "<<pthread_self()<<" is waiting"<<endl;
-//			printf("+++++++++++++lock++++++++++++++++++++++++++!\n");
-			printf("Thread 0x%x is waiting...\n", pthread_self());
+			int64_t idle_start = stdx::monotonic_nsec();
+			stdx::stat_add(stats.parks);
 			pthread_cond_wait(&(pthis->queue_ready), &(pthis->queue_lock));
+			stdx::stat_add(stats.idle_ns, stdx::monotonic_nsec() - idle_start);
 		}
 
 		if(pthis->shutdown == true)
 		{
-			printf("======================The pool will destroy!\n");
 			pthread_mutex_unlock(&(pthis->queue_lock));//退出之前一定要先解锁
-//			printf("======================unlock==============!\n");
-			printf("Thread 0x%x will exit\n",pthread_self());
 			pthread_exit(NULL);
 			return NULL;
 		}
 
 		assert(pthis->cur_queue_size != 0);
 		assert(pthis->queue_head != NULL);
-		Thread_worker* head = NULL;
-		head = pthis->queue_head;
-		pthis->queue_head = (pthis->queue_head)->next;//将等待队列中的第一个任务取出来执行
+		Thread_worker* head = pthis->queue_head;
+		pthis->queue_head = head->next;//将等待队列中的第一个任务取出来执行
+		if(pthis->queue_head == NULL)
+		{
+			pthis->queue_tail = NULL;
+		}
 		pthis->cur_queue_size--; //任务取出一个，等待队列就减1
 
-		pthread_mutex_unlock(&(pthis->queue_lock));
-//		printf("+++++++++++++unlock++++++++++++++++++++++++!\n");
+		//取出任务后节点马上还给节点池,还在锁内
+		Thread_worker job = *head;
+		head->next = pthis->free_workers;
+		pthis->free_workers = head;
 
-		printf("Thread 0x%x is starting to work\n",pthread_self());
+		pthread_mutex_unlock(&(pthis->queue_lock));
 
-		(*(head->process))(head->arg);//调用自己的函数执行自己的任务
-		printf("pthread 0x%x is complete=====================================================\n", pthread_self());
-		free(head);
-		head = NULL;
+		int64_t run_start = stdx::monotonic_nsec();
+		stats.wait.record(run_start - job.enqueue_ns);
+		(*(job.process))(job.arg);//调用自己的函数执行自己的任务
+		stats.run.record(stdx::monotonic_nsec() - run_start);
+		stdx::stat_add(stats.executed);
 	}
 	pthread_exit(NULL);
 }
 
 
+Thread_worker* ThreadPool::alloc_worker()
+{
+	if(free_workers == NULL)
+	{
+		Thread_worker* chunk = new Thread_worker[WORKER_CHUNK_SIZE];
+		worker_chunks.push_back(chunk);
+		for(int i = 0; i < WORKER_CHUNK_SIZE; i++)
+		{
+			chunk[i].next = free_workers;
+			free_workers = &chunk[i];
+		}
+	}
+	Thread_worker* worker = free_workers;
+	free_workers = worker->next;
+	return worker;
+}
+
+
 int ThreadPool::pool_add_worker(void* (*process)(void* arg),void* arg)
 {
-	printf("*********************************************Starting add task %d to pool......\n", *((int*)arg));
-	Thread_worker* newworker = new Thread_worker;
+	int64_t now = stdx::monotonic_nsec();
+
+	pthread_mutex_lock(&queue_lock);
+	Thread_worker* newworker = alloc_worker();
 	newworker->process = process;
 	newworker->arg = arg;
+	newworker->enqueue_ns = now;
 	newworker->next = NULL;
 
-	pthread_mutex_lock(&queue_lock);
-	Thread_worker* TempWorker = queue_head;
-
-	if(TempWorker != NULL)
+	//直接挂到队尾,不用再从队头遍历
+	if(queue_tail != NULL)
 	{
-		while(TempWorker->next != NULL)
-		{
-			TempWorker = TempWorker->next;
-		}
-		TempWorker->next = newworker;
+		queue_tail->next = newworker;
 	}
 	else
 	{
 		queue_head = newworker;
 	}
-	TempWorker = NULL;
+	queue_tail = newworker;
 	cur_queue_size++;
+	if(cur_queue_size > queue_hwm)
+	{
+		__atomic_store_n(&queue_hwm, cur_queue_size, __ATOMIC_RELAXED);
+	}
 	pthread_mutex_unlock(&queue_lock);
 
 	//唤醒一个空闲的线程来执行任务
 	pthread_cond_signal(&queue_ready);
-	printf("Awake a free thread to work!=================================================\n");
 	return 0;
 }
 
@@ -122,37 +156,56 @@ int ThreadPool::pool_destroy()
 	}
 
 	/*********************************************************/
-	printf("All the thread had exited!\n");
-	printf("Releasing resource and space......\n");
+	fprintf(stderr, "All the thread had exited!\n");
+	fprintf(stderr, "Releasing resource and space......\n");
 	/*********************************************************/
-	while(queue_head != NULL)
+	//没执行的任务和空闲节点都在节点块里
+	for(size_t i = 0; i < worker_chunks.size(); i++)
 	{
-		Thread_worker* head = queue_head;
-		queue_head = queue_head->next;
-		free(head);
+		delete [] worker_chunks[i];
 	}
+	worker_chunks.clear();
+	queue_head = queue_tail = free_workers = NULL;
 
 	/*销毁存放线程ID的空间*/
 	free(threadid);
+	delete [] thread_stats;
 
 	/*销毁互斥量和信号量*/
 	pthread_mutex_destroy(&queue_lock);
 	pthread_cond_destroy(&queue_ready);
 
-	printf("Okay,exit!\n");
+	fprintf(stderr, "Okay,exit!\n");
 	return 0;
 }
 
 
+int ThreadPool::get_max_thread_num()
+{
+	return max_thread_num;
+}
 
 
-
-
-
-
-
-
-
-
-
-
+//工作线程只写自己的Thread_stats,这里读的时候不加锁,所以各项之间只是近似一致
+ThreadPool_stats ThreadPool::snapshot()
+{
+	ThreadPool_stats result;
+	result.total = Thread_stats();
+	result.threads.resize(max_thread_num, Thread_stats());
+	for(int i = 0; i < max_thread_num; i++)
+	{
+		Thread_stats& from = thread_stats[i];
+		Thread_stats* to[2] = { &result.total, &result.threads[i] };
+		for(int j = 0; j < 2; j++)
+		{
+			to[j]->executed += stdx::stat_load(from.executed);
+			to[j]->idle_ns += stdx::stat_load(from.idle_ns);
+			to[j]->parks += stdx::stat_load(from.parks);
+			to[j]->wait.merge(from.wait);
+			to[j]->run.merge(from.run);
+		}
+	}
+	result.cur_queue_size = __atomic_load_n(&cur_queue_size, __ATOMIC_RELAXED);
+	result.queue_hwm = __atomic_load_n(&queue_hwm, __ATOMIC_RELAXED);
+	return result;
+}
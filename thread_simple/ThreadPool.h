@@ -10,16 +10,39 @@
 #define THREAD_POOL_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <vector>
+#include "stdx/stdx_stats.h"
 
 
 typedef struct Pworker
 {
 	void* (*process) (void* arg);
 	void* arg;
+	int64_t enqueue_ns;		//入队时间,用于统计排队时间
 	struct Pworker* next;
 }Thread_worker;
 
+//每个线程自己的统计,只有该线程写(不加锁),snapshot()随时可读
+typedef struct Pstats
+{
+	uint64_t executed;				//执行的任务数
+	uint64_t idle_ns;				//在queue_ready上等待的时间
+	uint64_t parks;					//等待的次数
+	stdx::latency_histogram wait;	//任务排队时间(ns)
+	stdx::latency_histogram run;	//任务执行时间(ns)
+}Thread_stats;
+
+//snapshot()的结果:所有线程的统计之和,以及每个线程各自的统计
+typedef struct Ppool_stats
+{
+	Thread_stats total;
+	std::vector<Thread_stats> threads;
+	int cur_queue_size;
+	int queue_hwm;					//等待队列的最大长度
+}ThreadPool_stats;
+
 class ThreadPool
 {
 private:
@@ -29,13 +52,21 @@ private:
 	bool shutdown;
 	pthread_t* threadid;
 	Thread_worker* queue_head;
+	Thread_worker* queue_tail;		//队尾,入队O(1)
 	int cur_queue_size;
+	Thread_worker* free_workers;	//用完的节点,下次入队复用
+	std::vector<Thread_worker*> worker_chunks;	//节点按块分配,销毁时一起释放
+	int queue_hwm;
+	Thread_stats* thread_stats;
+	int next_index;
 public:
 	ThreadPool(int max_thread_num);
 	//线程池的初始化
 	void pool_init();
 	//线程池处理例程
 	static void* thread_routine(void* arg);
+	//从节点池取一个节点,调用者持有queue_lock
+	Thread_worker* alloc_worker();
 
 	//接受任务(即向线程池中添加任务)
 	int pool_add_worker(void* (*process)(void* arg),void* arg);
@@ -43,6 +74,8 @@ public:
 	int pool_destroy();
 	//获取线程池的最大活动线程数
 	int get_max_thread_num();
+	//统计信息,不会停止工作线程
+	ThreadPool_stats snapshot();
 	
 };
 
@@ -0,0 +1,89 @@
+/***************************************************************************/
+/*文件名：bench_enqueue.cpp
+ *测量ThreadPool::pool_add_worker在队列越来越长时的入队开销
+ *
+ *工作线程先被gate_task挡住,队列里的任务一直积压到1M个,
+ *每入队100000个打印一次平均每次的耗时,应该基本不变
+ * */
+/***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ThreadPool.h"
+#include "stdx/stdx_time.h"
+
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gate_cond = PTHREAD_COND_INITIALIZER;
+static bool gate_open = false;
+static int  gate_waiting = 0;
+
+void* gate_task(void* arg)
+{
+	pthread_mutex_lock(&gate_lock);
+	gate_waiting++;
+	while(!gate_open)
+	{
+		pthread_cond_wait(&gate_cond, &gate_lock);
+	}
+	pthread_mutex_unlock(&gate_lock);
+	return NULL;
+}
+
+void* empty_task(void* arg)
+{
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	long total = argc > 2 ? atol(argv[2]) : 1000000;
+	long step = total / 10 > 0 ? total / 10 : 1;
+
+	ThreadPool pool(threads);
+	pool.pool_init();
+
+	//挡住所有的工作线程
+	for(int i = 0; i < threads; i++)
+	{
+		pool.pool_add_worker(gate_task, NULL);
+	}
+	while(true)
+	{
+		pthread_mutex_lock(&gate_lock);
+		bool all = gate_waiting == threads;
+		pthread_mutex_unlock(&gate_lock);
+		if(all) break;
+		usleep(1000);
+	}
+
+	printf("queued\tns/enqueue\n");
+	for(long done = 0; done < total; )
+	{
+		long n = total - done < step ? total - done : step;
+		int64_t start = stdx::monotonic_nsec();
+		for(long i = 0; i < n; i++)
+		{
+			pool.pool_add_worker(empty_task, NULL);
+		}
+		int64_t elapsed = stdx::monotonic_nsec() - start;
+		done += n;
+		printf("%ld\t%.1f\n", done, (double)elapsed / n);
+	}
+
+	pthread_mutex_lock(&gate_lock);
+	gate_open = true;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_lock);
+
+	int64_t start = stdx::monotonic_nsec();
+	while(pool.snapshot().total.executed < (uint64_t)(total + threads))
+	{
+		usleep(1000);
+	}
+	printf("drained %ld tasks in %.1f ms\n", total, (stdx::monotonic_nsec() - start) / 1e6);
+
+	pool.pool_destroy();
+	return 0;
+}